@@ -0,0 +1,97 @@
+#include "lalloc.h"
+#include <stdlib.h>
+
+/* Number of nodes carved out of each slab */
+#define LPOOL_SLAB 512
+
+/* The link is kept clear of the first word of a node, so a free lval keeps
+   the zero reference count lval_del left behind and can be told apart from
+   a live one when walking the heap. */
+typedef struct lfree {
+    void *unused;
+    struct lfree *next;
+} lfree;
+
+typedef struct lslab {
+    struct lslab *next;
+} lslab;
+
+typedef struct {
+    size_t size;
+    size_t live;
+    lfree *free;
+    lslab *slabs;
+} lpool;
+
+static lpool lval_pool = {sizeof(lval), 0, NULL, NULL};
+static lpool llambda_pool = {sizeof(llambda), 0, NULL, NULL};
+static lpool lenv_pool = {sizeof(lenv), 0, NULL, NULL};
+
+static void lpool_grow(lpool *p) {
+    /* Slab header followed by the nodes, zeroed so none looks live */
+    lslab *s = calloc(1, sizeof(lslab) + p->size * LPOOL_SLAB);
+    s->next = p->slabs;
+    p->slabs = s;
+
+    /* Push every node of the new slab onto the free list */
+    char *node = (char *)(s + 1);
+    for (int i = 0; i < LPOOL_SLAB; i++) {
+        lfree *f = (lfree *)(node + p->size * i);
+        f->next = p->free;
+        p->free = f;
+    }
+}
+
+static void *lpool_alloc(lpool *p) {
+    p->live++;
+#ifdef LALLOC_SYSTEM
+    return malloc(p->size);
+#else
+    if (!p->free) {
+        lpool_grow(p);
+    }
+
+    lfree *f = p->free;
+    p->free = f->next;
+
+    return f;
+#endif
+}
+
+static void lpool_free(lpool *p, void *x) {
+    p->live--;
+#ifdef LALLOC_SYSTEM
+    free(x);
+#else
+    lfree *f = x;
+    f->next = p->free;
+    p->free = f;
+#endif
+}
+
+lval *lval_alloc(void) { return lpool_alloc(&lval_pool); }
+
+void lval_free(lval *v) { lpool_free(&lval_pool, v); }
+
+size_t lval_live(void) { return lval_pool.live; }
+
+void lval_heap_each(void (*fn)(lval *, void *), void *ctx) {
+#ifndef LALLOC_SYSTEM
+    for (lslab *s = lval_pool.slabs; s; s = s->next) {
+        lval *v = (lval *)(s + 1);
+        for (int i = 0; i < LPOOL_SLAB; i++) {
+            if (v[i].refs > 0) {
+                fn(&v[i], ctx);
+            }
+        }
+    }
+#endif
+}
+
+llambda *llambda_alloc(void) { return lpool_alloc(&llambda_pool); }
+
+void llambda_free(llambda *l) { lpool_free(&llambda_pool, l); }
+
+lenv *lenv_alloc(void) { return lpool_alloc(&lenv_pool); }
+
+void lenv_free(lenv *e) { lpool_free(&lenv_pool, e); }
@@ -0,0 +1,25 @@
+#pragma once
+
+#include "lval.h"
+#include <stddef.h>
+
+/* Pooled allocation of lval, llambda and lenv nodes. Each type has its own
+   pool of fixed size slabs with a free list threaded through unused nodes, so
+   allocating or freeing a node is a pointer swap.
+
+   Build with -DLALLOC_SYSTEM to allocate every node with malloc instead,
+   for example when running under a memory checker. The heap of lval nodes
+   cannot be walked then, so the collector finds nothing to do. */
+
+lval *lval_alloc(void);
+void lval_free(lval *v);
+
+/* Number of lval nodes in use, and a walk over each of them */
+size_t lval_live(void);
+void lval_heap_each(void (*fn)(lval *, void *), void *ctx);
+
+llambda *llambda_alloc(void);
+void llambda_free(llambda *l);
+
+lenv *lenv_alloc(void);
+void lenv_free(lenv *e);
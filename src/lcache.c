@@ -0,0 +1,264 @@
+#define _XOPEN_SOURCE 700
+
+#include "lcache.h"
+#include "limage.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Largest file to cache. Anything bigger is read a form at a time. */
+#ifndef LCACHE_MAX
+#define LCACHE_MAX (1024 * 1024)
+#endif
+
+#define LCACHE_MAGIC "LSPYCHE3"
+#define LCACHE_ORDER 0x01020304u
+
+/* Files cached in the process */
+typedef struct {
+    lcache_key key;
+    lval *forms;
+} lcache_entry;
+
+static lcache_entry *cache = NULL;
+static int cache_count = 0;
+static int cache_cap = 0;
+
+/* Whether the cache on disk is used */
+static int cache_disk = 1;
+
+static uint64_t lcache_hash(char *s, size_t n) {
+    /* FNV-1a */
+    uint64_t h = 14695981039346656037UL;
+    for (size_t i = 0; i < n; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 1099511628211UL;
+    }
+    return h;
+}
+
+static int lcache_key_eq(lcache_key *x, lcache_key *y) {
+    return x->mtime == y->mtime && x->mtime_ns == y->mtime_ns &&
+           x->size == y->size && x->hash == y->hash &&
+           strcmp(x->path, y->path) == 0;
+}
+
+static char *lcache_join(char *dir, char *name) {
+    char *path = malloc(strlen(dir) + strlen(name) + 2);
+    sprintf(path, "%s/%s", dir, name);
+    return path;
+}
+
+/* Directory of the cache on disk, created if need be, or NULL */
+static char *lcache_dir(void) {
+    if (!cache_disk) {
+        return NULL;
+    }
+
+    char *dir = getenv("LISPY_CACHE");
+    if (dir) {
+        if (!*dir) {
+            return NULL;
+        }
+        dir = strcpy(malloc(strlen(dir) + 1), dir);
+    } else {
+        char *base = getenv("XDG_CACHE_HOME");
+        if (base && *base) {
+            mkdir(base, 0755);
+            dir = lcache_join(base, "lispy");
+        } else {
+            char *home = getenv("HOME");
+            if (!home || !*home) {
+                return NULL;
+            }
+            base = lcache_join(home, ".cache");
+            mkdir(base, 0755);
+            dir = lcache_join(base, "lispy");
+            free(base);
+        }
+    }
+
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+        free(dir);
+        return NULL;
+    }
+    return dir;
+}
+
+/* Name of the file caching the forms of the file keyed by k, or NULL */
+static char *lcache_file(lcache_key *k) {
+    char *dir = lcache_dir();
+    if (!dir) {
+        return NULL;
+    }
+
+    char name[32];
+    sprintf(name, "%016llx.lsc",
+            (unsigned long long)lcache_hash(k->path, strlen(k->path)));
+    char *file = lcache_join(dir, name);
+    free(dir);
+    return file;
+}
+
+static void lcache_write_key(FILE *f, lcache_key *k) {
+    uint32_t order = LCACHE_ORDER;
+    uint32_t len = strlen(k->path);
+    fwrite(LCACHE_MAGIC, 1, strlen(LCACHE_MAGIC), f);
+    fwrite(&order, sizeof(uint32_t), 1, f);
+    fwrite(&len, sizeof(uint32_t), 1, f);
+    fwrite(k->path, 1, len, f);
+    fwrite(&k->mtime, sizeof(int64_t), 1, f);
+    fwrite(&k->mtime_ns, sizeof(int64_t), 1, f);
+    fwrite(&k->size, sizeof(uint64_t), 1, f);
+    fwrite(&k->hash, sizeof(uint64_t), 1, f);
+}
+
+/* Forms cached on disk for the file keyed by k, or NULL */
+static lval *lcache_load(lenv *e, lcache_key *k) {
+    char *file = lcache_file(k);
+    if (!file) {
+        return NULL;
+    }
+    int fd = open(file, O_RDONLY);
+    free(file);
+    if (fd == -1) {
+        return NULL;
+    }
+
+    struct stat st;
+    char *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    /* The header must match the key byte for byte */
+    char *key;
+    size_t len;
+    FILE *f = open_memstream(&key, &len);
+    lcache_write_key(f, k);
+    fclose(f);
+
+    lval *forms = NULL;
+    if ((size_t)st.st_size > len && memcmp(map, key, len) == 0) {
+        forms = limage_read(e, map + len, st.st_size - len);
+    }
+    if (forms && forms->type != LVAL_QEXPR) {
+        lval_del(forms);
+        forms = NULL;
+    }
+
+    free(key);
+    munmap(map, st.st_size);
+    return forms;
+}
+
+/* Write forms to disk for the file keyed by k. The cache file is replaced
+   in one step, so processes racing to write it never see it half done. */
+static void lcache_save(lcache_key *k, lval *forms) {
+    char *file = lcache_file(k);
+    if (!file) {
+        return;
+    }
+
+    char *tmp = malloc(strlen(file) + 32);
+    sprintf(tmp, "%s.%ld.tmp", file, (long)getpid());
+
+    FILE *f = fopen(tmp, "wb");
+    if (f) {
+        lcache_write_key(f, k);
+        limage_write(f, forms);
+        if ((ferror(f) | fclose(f)) || rename(tmp, file) == -1) {
+            unlink(tmp);
+        }
+    }
+
+    free(tmp);
+    free(file);
+}
+
+/* Keep forms in the process as the contents of the file keyed by k, in
+   place of anything kept for the same path before */
+static void lcache_keep(lcache_key *k, lval *forms) {
+    for (int i = 0; i < cache_count; i++) {
+        if (strcmp(cache[i].key.path, k->path) == 0) {
+            lval_del(cache[i].forms);
+            free(cache[i].key.path);
+            cache[i] = cache[--cache_count];
+            break;
+        }
+    }
+
+    if (cache_count == cache_cap) {
+        cache_cap = cache_cap ? cache_cap * 2 : 16;
+        cache = realloc(cache, sizeof(lcache_entry) * cache_cap);
+    }
+    cache[cache_count].key = *k;
+    cache[cache_count].forms = forms;
+    cache_count++;
+}
+
+lval *lcache_get(lenv *e, lreader *r, lcache_key *k) {
+    k->path = NULL;
+
+    /* Only files read straight from a mapping are cached */
+    struct stat st;
+    if (!r->map || r->map > LCACHE_MAX || stat(r->name, &st) == -1) {
+        return NULL;
+    }
+    k->path = realpath(r->name, NULL);
+    if (!k->path) {
+        return NULL;
+    }
+    k->mtime = st.st_mtim.tv_sec;
+    k->mtime_ns = st.st_mtim.tv_nsec;
+    k->size = r->end - r->buf;
+    k->hash = lcache_hash(r->buf, r->end - r->buf);
+
+    for (int i = 0; i < cache_count; i++) {
+        if (lcache_key_eq(&cache[i].key, k)) {
+            free(k->path);
+            k->path = NULL;
+            return lval_ref(cache[i].forms);
+        }
+    }
+
+    /* The process keeps the key of forms read from disk */
+    lval *forms = lcache_load(e, k);
+    if (forms) {
+        lcache_keep(k, lval_ref(forms));
+        k->path = NULL;
+    }
+    return forms;
+}
+
+void lcache_put(lcache_key *k, lval *forms) {
+    if (!forms) {
+        free(k->path);
+        return;
+    }
+    lcache_save(k, forms);
+    lcache_keep(k, forms);
+}
+
+void lcache_clear(void) {
+    for (int i = 0; i < cache_count; i++) {
+        lval_del(cache[i].forms);
+        free(cache[i].key.path);
+    }
+    free(cache);
+    cache = NULL;
+    cache_count = 0;
+    cache_cap = 0;
+}
+
+void lcache_disable_disk(void) { cache_disk = 0; }
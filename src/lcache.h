@@ -0,0 +1,42 @@
+#pragma once
+
+#include "lread.h"
+#include "lval.h"
+#include <stdint.h>
+
+/* Cache of the forms read from loaded files, kept in the process and on
+   disk so a file loaded again, here or by a later process, is not read
+   again. Files are keyed by path, modification time and a hash of their
+   contents, and only files small enough to hold in memory are cached.
+
+   The cache on disk is in the directory named by LISPY_CACHE, or in lispy
+   under XDG_CACHE_HOME or ~/.cache. It is not used when LISPY_CACHE is
+   set but empty or once lcache_disable_disk has been called, and it is
+   quietly skipped when its directory cannot be created or written. */
+
+typedef struct {
+    /* Absolute path of the file, or NULL if it is not to be cached */
+    char *path;
+
+    /* Modification time, size and hash of the contents */
+    int64_t mtime;
+    int64_t mtime_ns;
+    uint64_t size;
+    uint64_t hash;
+} lcache_key;
+
+/* Look up the forms of the file r has just opened, defining any lambdas
+   in them in e. Returns the forms if they are cached. Otherwise returns
+   NULL and fills in k, with a NULL path if the file is not to be cached,
+   for the forms to be cached under once they have been read. */
+lval *lcache_get(lenv *e, lreader *r, lcache_key *k);
+
+/* Cache forms, if not NULL, as the contents of the file keyed by k, and
+   release the key */
+void lcache_put(lcache_key *k, lval *forms);
+
+/* Drop every file cached in the process */
+void lcache_clear(void);
+
+/* Stop using the cache on disk, leaving only the one in the process */
+void lcache_disable_disk(void);
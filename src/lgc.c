@@ -0,0 +1,109 @@
+#include "lgc.h"
+#include "lalloc.h"
+#include <stdlib.h>
+
+/* Number of live values below which no collection is made */
+#ifndef LGC_MIN
+#define LGC_MIN 65536
+#endif
+
+/* Added to the reference count of values reached while marking */
+#define LGC_MARK (1 << 30)
+
+typedef struct {
+    int count;
+    int cap;
+    lval **items;
+} lgc_list;
+
+static int lgc_pass = 0;
+static size_t lgc_next = LGC_MIN;
+
+static void lgc_push(lval *v, void *ctx) {
+    lgc_list *l = ctx;
+    if (l->count == l->cap) {
+        l->cap = l->cap ? l->cap * 2 : 1024;
+        l->items = realloc(l->items, sizeof(lval *) * l->cap);
+    }
+    l->items[l->count++] = v;
+}
+
+static void lgc_unref(lval *v, void *ctx) { v->refs--; }
+
+static void lgc_reref(lval *v, void *ctx) { v->refs++; }
+
+static void lgc_reach(lval *v, void *ctx) {
+    if (v->refs < LGC_MARK) {
+        v->refs += LGC_MARK;
+        lgc_push(v, ctx);
+    }
+}
+
+int lgc_collect(void) {
+    lgc_list heap = {0, 0, NULL};
+    lval_heap_each(lgc_push, &heap);
+
+    /* Take away the references values in the heap hold to each other. What
+       is left counts the references from outside, which are the roots. */
+    lgc_pass++;
+    for (int i = 0; i < heap.count; i++) {
+        lval_each_child(heap.items[i], lgc_pass, lgc_unref, NULL);
+    }
+
+    /* Mark everything reachable from a root */
+    lgc_list stack = {0, 0, NULL};
+    for (int i = 0; i < heap.count; i++) {
+        if (heap.items[i]->refs > 0) {
+            lgc_reach(heap.items[i], &stack);
+        }
+    }
+    lgc_pass++;
+    while (stack.count) {
+        lval *v = stack.items[--stack.count];
+        lval_each_child(v, lgc_pass, lgc_reach, &stack);
+    }
+    free(stack.items);
+
+    /* Give back the references taken away above */
+    lgc_pass++;
+    for (int i = 0; i < heap.count; i++) {
+        lval_each_child(heap.items[i], lgc_pass, lgc_reref, NULL);
+    }
+
+    /* Unmark, keeping what was not reached */
+    int n = 0;
+    for (int i = 0; i < heap.count; i++) {
+        lval *v = heap.items[i];
+        if (v->refs >= LGC_MARK) {
+            v->refs -= LGC_MARK;
+        } else {
+            heap.items[n++] = v;
+        }
+    }
+
+    /* The garbage is only referenced from itself. Hold it all while the
+       references between it are dropped, then free each value. */
+    for (int i = 0; i < n; i++) {
+        lval_ref(heap.items[i]);
+    }
+    for (int i = 0; i < n; i++) {
+        lval_clear(heap.items[i]);
+    }
+    for (int i = 0; i < n; i++) {
+        lval_del(heap.items[i]);
+    }
+    free(heap.items);
+
+    lgc_next = lval_live() * 2;
+    if (lgc_next < LGC_MIN) {
+        lgc_next = LGC_MIN;
+    }
+
+    return n;
+}
+
+void lgc_poll(void) {
+    if (lval_live() >= lgc_next) {
+        lgc_collect();
+    }
+}
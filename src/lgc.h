@@ -0,0 +1,17 @@
+#pragma once
+
+#include "lval.h"
+
+/* Tracing collector for the lval heap.
+
+   Reference counting frees most values as soon as they are dropped, but
+   not values which refer to each other in a cycle. The collector finds
+   those. Every reference into the heap from outside it, whether from an
+   environment, the evaluator or a C local, keeps a value alive, so a
+   collection may run at any point where reference counts are exact. */
+
+/* Collect now, returning the number of values freed */
+int lgc_collect(void);
+
+/* Collect if the heap has grown enough since the last collection */
+void lgc_poll(void);
@@ -0,0 +1,580 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "limage.h"
+#include "lmap.h"
+#include "vm.h"
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Header, followed by the number of bindings and each name and value */
+#define LIMAGE_MAGIC "LSPYIMG3"
+#define LIMAGE_ORDER 0x01020304u
+
+/* Tags of the entries in an image. Values and frames are numbered in the
+   order they first appear, so later uses can refer back to them. */
+enum {
+    LIMG_NUM,
+    LIMG_ERR,
+    LIMG_SYM,
+    LIMG_STR,
+    LIMG_BUILTIN,
+    LIMG_LAMBDA,
+    LIMG_SEXPR,
+    LIMG_QEXPR,
+    LIMG_VEC,
+    LIMG_MAP,
+    LIMG_FRAME,
+    LIMG_NOFRAME,
+    LIMG_ROOT,
+    LIMG_REF
+};
+
+/* Writing */
+
+typedef struct {
+    /* Image written so far */
+    char *buf;
+    size_t len;
+    size_t size;
+
+    lenv *root;
+
+    /* Values and frames already written, keyed by address */
+    void **keys;
+    uint32_t *ids;
+    uint32_t count;
+    uint32_t cap;
+} ldump;
+
+static void ldump_put(ldump *d, void *p, size_t n) {
+    if (d->len + n > d->size) {
+        while (d->len + n > d->size) {
+            d->size = d->size ? d->size * 2 : 4096;
+        }
+        d->buf = realloc(d->buf, d->size);
+    }
+    memcpy(d->buf + d->len, p, n);
+    d->len += n;
+}
+
+static void ldump_byte(ldump *d, uint8_t c) { ldump_put(d, &c, 1); }
+
+static uint32_t ldump_slot(ldump *d, void *p) {
+    uint32_t i = ((uintptr_t)p >> 4) * 2654435761u & (d->cap - 1);
+    while (d->keys[i] && d->keys[i] != p) {
+        i = (i + 1) & (d->cap - 1);
+    }
+    return i;
+}
+
+/* Number p if it is new and return 1, otherwise write a reference to it */
+static int ldump_new(ldump *d, void *p) {
+    if ((d->count + 1) * 2 > d->cap) {
+        void **keys = d->keys;
+        uint32_t *ids = d->ids;
+        uint32_t cap = d->cap;
+
+        d->cap = cap ? cap * 2 : 256;
+        d->keys = calloc(d->cap, sizeof(void *));
+        d->ids = malloc(sizeof(uint32_t) * d->cap);
+        for (uint32_t i = 0; i < cap; i++) {
+            if (keys[i]) {
+                uint32_t j = ldump_slot(d, keys[i]);
+                d->keys[j] = keys[i];
+                d->ids[j] = ids[i];
+            }
+        }
+        free(keys);
+        free(ids);
+    }
+
+    uint32_t i = ldump_slot(d, p);
+    if (d->keys[i]) {
+        ldump_byte(d, LIMG_REF);
+        ldump_put(d, &d->ids[i], sizeof(uint32_t));
+        return 0;
+    }
+
+    d->keys[i] = p;
+    d->ids[i] = d->count++;
+    return 1;
+}
+
+static void ldump_str(ldump *d, char *s) {
+    uint32_t len = strlen(s);
+    ldump_put(d, &len, sizeof(uint32_t));
+    ldump_put(d, s, len);
+}
+
+static void ldump_value(ldump *d, lval *v);
+
+static void ldump_frame(ldump *d, lenv *env) {
+    if (!env) {
+        ldump_byte(d, LIMG_NOFRAME);
+        return;
+    }
+    if (env == d->root) {
+        ldump_byte(d, LIMG_ROOT);
+        return;
+    }
+    if (!ldump_new(d, env)) {
+        return;
+    }
+
+    ldump_byte(d, LIMG_FRAME);
+    ldump_frame(d, env->up);
+
+    uint32_t count = env->count;
+    ldump_put(d, &count, sizeof(uint32_t));
+    for (int i = 0; i < env->cap; i++) {
+        if (env->syms[i]) {
+            ldump_str(d, env->syms[i]);
+            ldump_value(d, env->vals[i]);
+        }
+    }
+}
+
+static void ldump_value(ldump *d, lval *v) {
+    if (v->type == LVAL_NUM) {
+        int64_t x = v->num;
+        ldump_byte(d, LIMG_NUM);
+        ldump_put(d, &x, sizeof(int64_t));
+        return;
+    }
+
+    if (!ldump_new(d, v)) {
+        return;
+    }
+
+    switch (v->type) {
+    /* Each symbol has one lval, so is written once and referred back to */
+    case LVAL_SYM:
+        ldump_byte(d, LIMG_SYM);
+        ldump_str(d, v->sym);
+        break;
+
+    case LVAL_ERR:
+        ldump_byte(d, LIMG_ERR);
+        ldump_str(d, v->err);
+        break;
+
+    case LVAL_STR:
+        ldump_byte(d, LIMG_STR);
+        ldump_str(d, v->str);
+        break;
+
+    case LVAL_FUN:
+        if (v->builtin) {
+            ldump_byte(d, LIMG_BUILTIN);
+            ldump_str(d, lbuiltin_name(v->builtin));
+        } else {
+            ldump_byte(d, LIMG_LAMBDA);
+            ldump_frame(d, v->lambda->env);
+            ldump_value(d, v->lambda->formals);
+            ldump_value(d, v->lambda->body);
+        }
+        break;
+
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+    case LVAL_VEC: {
+        uint32_t count = v->count;
+        ldump_byte(d, v->type == LVAL_SEXPR   ? LIMG_SEXPR
+                      : v->type == LVAL_QEXPR ? LIMG_QEXPR
+                                              : LIMG_VEC);
+        ldump_put(d, &count, sizeof(uint32_t));
+        for (int i = 0; i < v->count; i++) {
+            ldump_value(d, v->cell[i]);
+        }
+        break;
+    }
+
+    case LVAL_MAP: {
+        uint32_t count = v->map->count;
+        ldump_byte(d, LIMG_MAP);
+        ldump_put(d, &count, sizeof(uint32_t));
+        for (int i = 0; i < v->map->cap; i++) {
+            if (v->map->slots[i].key) {
+                ldump_value(d, v->map->slots[i].key);
+                ldump_value(d, v->map->slots[i].val);
+            }
+        }
+        break;
+    }
+    }
+}
+
+/* Write out the image in d and free it */
+static void ldump_flush(ldump *d, FILE *f) {
+    fwrite(d->buf, 1, d->len, f);
+    free(d->buf);
+    free(d->keys);
+    free(d->ids);
+}
+
+void limage_write(FILE *f, lval *v) {
+    ldump d = {NULL, 0, 0, NULL, NULL, NULL, 0, 0};
+    ldump_value(&d, v);
+    ldump_flush(&d, f);
+}
+
+lval *limage_dump(lenv *e, char *path) {
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        return lval_err("Could not write image %s", path);
+    }
+
+    ldump d = {NULL, 0, 0, e, NULL, NULL, 0, 0};
+
+    uint32_t order = LIMAGE_ORDER;
+    uint32_t count = e->count;
+    ldump_put(&d, LIMAGE_MAGIC, strlen(LIMAGE_MAGIC));
+    ldump_put(&d, &order, sizeof(uint32_t));
+    ldump_put(&d, &count, sizeof(uint32_t));
+
+    for (int i = 0; i < e->cap; i++) {
+        if (e->syms[i]) {
+            ldump_str(&d, e->syms[i]);
+            ldump_value(&d, e->vals[i]);
+        }
+    }
+    ldump_flush(&d, f);
+
+    if (ferror(f) | fclose(f)) {
+        return lval_err("Could not write image %s", path);
+    }
+    return NULL;
+}
+
+/* Reading */
+
+typedef struct {
+    char *s;
+    char *end;
+    lenv *root;
+
+    /* Values and frames read so far, in the order they were numbered */
+    void **objs;
+    char *kinds;
+    uint32_t count;
+    uint32_t cap;
+
+    /* Set once anything in the image is found to be wrong */
+    int bad;
+} lload;
+
+static void lload_get(lload *r, void *x, size_t n) {
+    if ((size_t)(r->end - r->s) < n) {
+        r->bad = 1;
+        memset(x, 0, n);
+        return;
+    }
+    memcpy(x, r->s, n);
+    r->s += n;
+}
+
+static int lload_tag(lload *r) {
+    uint8_t tag = LIMG_NOFRAME;
+    lload_get(r, &tag, 1);
+    return tag;
+}
+
+static uint32_t lload_u32(lload *r) {
+    uint32_t x;
+    lload_get(r, &x, sizeof(uint32_t));
+    return x;
+}
+
+/* Length and start of a string in the image, which is not nul terminated */
+static char *lload_str(lload *r, uint32_t *len) {
+    *len = lload_u32(r);
+    if ((size_t)(r->end - r->s) < *len) {
+        r->bad = 1;
+        *len = 0;
+    }
+    char *s = r->s;
+    r->s += *len;
+    return s;
+}
+
+/* Copy of a string in the image */
+static char *lload_cstr(lload *r) {
+    uint32_t len;
+    char *s = lload_str(r, &len);
+    char *x = malloc(len + 1);
+    memcpy(x, s, len);
+    x[len] = '\0';
+    return x;
+}
+
+static void lload_add(lload *r, void *p, char kind) {
+    if (r->count == r->cap) {
+        r->cap = r->cap ? r->cap * 2 : 256;
+        r->objs = realloc(r->objs, sizeof(void *) * r->cap);
+        r->kinds = realloc(r->kinds, r->cap);
+    }
+    r->objs[r->count] = p;
+    r->kinds[r->count] = kind;
+    r->count++;
+}
+
+/* Object referred to by the next id, or NULL if it is not of this kind */
+static void *lload_ref(lload *r, char kind) {
+    uint32_t id = lload_u32(r);
+    if (id >= r->count || r->kinds[id] != kind) {
+        r->bad = 1;
+        return NULL;
+    }
+    return r->objs[id];
+}
+
+static lval *lload_value(lload *r);
+
+/* Values which are not what they claim to be are replaced by an empty
+   list, so whatever has been read can still be freed */
+static lval *lload_bad(lload *r) {
+    r->bad = 1;
+    return lval_sexpr();
+}
+
+static lenv *lload_frame(lload *r) {
+    switch (lload_tag(r)) {
+    case LIMG_NOFRAME:
+        return NULL;
+
+    case LIMG_ROOT:
+        return lenv_ref(r->root);
+
+    case LIMG_REF: {
+        lenv *env = lload_ref(r, 'e');
+        return env ? lenv_ref(env) : NULL;
+    }
+
+    case LIMG_FRAME: {
+        lenv *env = lenv_new();
+        lload_add(r, env, 'e');
+        env->up = lload_frame(r);
+        if (!env->up) {
+            /* Every frame extends the root in the end */
+            env->up = lenv_ref(r->root);
+        }
+
+        uint32_t count = lload_u32(r);
+        for (uint32_t i = 0; i < count && !r->bad; i++) {
+            uint32_t len;
+            char *name = lload_str(r, &len);
+            lval *k = lval_sym_len(name, len);
+            lval *v = lload_value(r);
+            lenv_put(env, k, v);
+            lval_del(k);
+            lval_del(v);
+        }
+        return env;
+    }
+    }
+
+    r->bad = 1;
+    return NULL;
+}
+
+static int lload_is_formals(lval *v) {
+    if (v->type != LVAL_QEXPR) {
+        return 0;
+    }
+    for (int i = 0; i < v->count; i++) {
+        if (v->cell[i]->type != LVAL_SYM) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static lval *lload_value(lload *r) {
+    int tag = lload_tag(r);
+    switch (tag) {
+    case LIMG_NUM: {
+        int64_t x;
+        lload_get(r, &x, sizeof(int64_t));
+        return lval_num(x);
+    }
+
+    case LIMG_SYM: {
+        uint32_t len;
+        char *name = lload_str(r, &len);
+        lval *v = lval_sym_len(name, len);
+        lload_add(r, v, 'v');
+        return v;
+    }
+
+    case LIMG_ERR: {
+        char *s = lload_cstr(r);
+        lval *v = lval_err("%s", s);
+        free(s);
+        lload_add(r, v, 'v');
+        return v;
+    }
+
+    case LIMG_STR: {
+        char *s = lload_cstr(r);
+        lval *v = lval_str(s);
+        free(s);
+        lload_add(r, v, 'v');
+        return v;
+    }
+
+    case LIMG_BUILTIN: {
+        char *name = lload_cstr(r);
+        lbuiltin f = lbuiltin_find(name);
+        free(name);
+        if (!f) {
+            return lload_bad(r);
+        }
+        lval *v = lval_fun(f);
+        lload_add(r, v, 'v');
+        return v;
+    }
+
+    case LIMG_LAMBDA: {
+        /* Numbered before its parts are read, as they may refer to it */
+        lval *v = lval_lambda(r->root, lval_qexpr(), lval_qexpr());
+        lload_add(r, v, 'v');
+
+        lenv *env = lload_frame(r);
+        if (env) {
+            lenv_del(v->lambda->env);
+            v->lambda->env = env;
+        }
+
+        lval *formals = lload_value(r);
+        lval *body = lload_value(r);
+        lval_del(v->lambda->formals);
+        lval_del(v->lambda->body);
+        v->lambda->formals = formals;
+        v->lambda->body = body;
+
+        if (!lload_is_formals(formals) || body->type != LVAL_QEXPR) {
+            r->bad = 1;
+        }
+        if (!r->bad) {
+            v->lambda->code = lcode_compile(formals, body);
+        }
+        return v;
+    }
+
+    case LIMG_SEXPR:
+    case LIMG_QEXPR:
+    case LIMG_VEC: {
+        lval *v = tag == LIMG_SEXPR   ? lval_sexpr()
+                  : tag == LIMG_QEXPR ? lval_qexpr()
+                                      : lval_vec();
+        lload_add(r, v, 'v');
+
+        uint32_t count = lload_u32(r);
+        if (count > (size_t)(r->end - r->s)) {
+            r->bad = 1;
+            return v;
+        }
+        lval_reserve(v, count);
+        for (uint32_t i = 0; i < count && !r->bad; i++) {
+            lval_add(v, lload_value(r));
+        }
+        return v;
+    }
+
+    case LIMG_MAP: {
+        lval *v = lval_map();
+        lload_add(r, v, 'v');
+
+        uint32_t count = lload_u32(r);
+        for (uint32_t i = 0; i < count && !r->bad; i++) {
+            lval *k = lload_value(r);
+            lval *x = lload_value(r);
+            if (!lmap_hashable(k)) {
+                r->bad = 1;
+                lval_del(k);
+                lval_del(x);
+                break;
+            }
+            lmap_put(v->map, k, x);
+        }
+        return v;
+    }
+
+    case LIMG_REF: {
+        lval *v = lload_ref(r, 'v');
+        return v ? lval_ref(v) : lload_bad(r);
+    }
+    }
+
+    return lload_bad(r);
+}
+
+lval *limage_read(lenv *e, char *s, size_t len) {
+    lload r = {s, s + len, e, NULL, NULL, 0, 0, 0};
+    lval *v = lload_value(&r);
+    free(r.objs);
+    free(r.kinds);
+
+    if (r.bad || r.s != r.end) {
+        lval_del(v);
+        return NULL;
+    }
+    return v;
+}
+
+lval *limage_load(lenv *e, char *path) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1 || st.st_size == 0) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return lval_err("Could not read image %s", path);
+    }
+
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return lval_err("Could not read image %s", path);
+    }
+
+    lload r = {map, map + st.st_size, e, NULL, NULL, 0, 0, 0};
+
+    char magic[sizeof(LIMAGE_MAGIC) - 1];
+    lload_get(&r, magic, sizeof(magic));
+    if (memcmp(magic, LIMAGE_MAGIC, sizeof(magic)) != 0 ||
+        lload_u32(&r) != LIMAGE_ORDER) {
+        r.bad = 1;
+    }
+
+    /* Read every binding before making any of them */
+    uint32_t count = lload_u32(&r);
+    lval *syms = lval_qexpr();
+    lval *vals = lval_qexpr();
+    for (uint32_t i = 0; i < count && !r.bad; i++) {
+        uint32_t len;
+        char *name = lload_str(&r, &len);
+        lval_add(syms, lval_sym_len(name, len));
+        lval_add(vals, lload_value(&r));
+    }
+
+    if (!r.bad) {
+        for (int i = 0; i < syms->count; i++) {
+            lenv_put(e, syms->cell[i], vals->cell[i]);
+        }
+    }
+
+    lval_del(syms);
+    lval_del(vals);
+    free(r.objs);
+    free(r.kinds);
+    munmap(map, st.st_size);
+
+    return r.bad ? lval_err("Invalid image %s", path) : NULL;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include "lval.h"
+#include <stdio.h>
+
+/* Images of the global environment. An image holds every binding of the
+   root environment, with values shared in memory shared in the image, so
+   a process can start from it instead of loading its libraries again.
+
+   Images are written in the byte order and word size of the machine and
+   are not portable between machines which differ in those. */
+
+/* Write the bindings of the root environment e to path. Returns an error,
+   or NULL on success. */
+lval *limage_dump(lenv *e, char *path);
+
+/* Bind everything in the image at path into the root environment e.
+   Returns an error, or NULL on success. */
+lval *limage_load(lenv *e, char *path);
+
+/* Write the value v to f, encoded as the values of an image are */
+void limage_write(FILE *f, lval *v);
+
+/* Read back a value written by limage_write from the len bytes at s, with
+   any lambdas in it defined in e. Returns NULL unless they hold exactly
+   one value. */
+lval *limage_read(lenv *e, char *s, size_t len);
@@ -0,0 +1,182 @@
+#include "lmap.h"
+#include "sym.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* Spread every bit of h over the result, so keys differing only in high
+   bits, such as numbers stepping by a power of two, land apart */
+static uint64_t lmap_mix(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static uint64_t lmap_hash_str(char *s) {
+    /* FNV-1a */
+    uint64_t h = 14695981039346656037ULL;
+    for (; *s; s++) {
+        h ^= (unsigned char)*s;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/* Keys of different types never compare equal, so the type is mixed in to
+   keep "a" and a apart */
+static uint64_t lmap_hash(lval *k) {
+    switch (k->type) {
+    case LVAL_NUM:
+        return lmap_mix((uint64_t)k->num);
+    case LVAL_STR:
+        return lmap_mix(lmap_hash_str(k->str) ^ LVAL_STR);
+    default:
+        return lmap_mix(sym_hash(k->sym) ^ LVAL_SYM);
+    }
+}
+
+static int lmap_key_eq(lval *x, lval *y) {
+    if (x->type != y->type) {
+        return 0;
+    }
+    switch (x->type) {
+    case LVAL_NUM:
+        return x->num == y->num;
+    case LVAL_STR:
+        return strcmp(x->str, y->str) == 0;
+    default:
+        return x->sym == y->sym;
+    }
+}
+
+int lmap_hashable(lval *k) {
+    return k->type == LVAL_NUM || k->type == LVAL_STR || k->type == LVAL_SYM;
+}
+
+lmap *lmap_new(void) {
+    lmap *m = malloc(sizeof(lmap));
+    m->count = 0;
+    m->cap = 0;
+    m->slots = NULL;
+    return m;
+}
+
+lmap *lmap_copy(lmap *m) {
+    lmap *x = malloc(sizeof(lmap));
+    x->count = m->count;
+    x->cap = m->cap;
+    x->slots = NULL;
+    if (m->cap) {
+        x->slots = malloc(sizeof(lmap_slot) * m->cap);
+        memcpy(x->slots, m->slots, sizeof(lmap_slot) * m->cap);
+        for (int i = 0; i < m->cap; i++) {
+            if (x->slots[i].key) {
+                lval_ref(x->slots[i].key);
+                lval_ref(x->slots[i].val);
+            }
+        }
+    }
+    return x;
+}
+
+void lmap_del(lmap *m) {
+    for (int i = 0; i < m->cap; i++) {
+        if (m->slots[i].key) {
+            lval_del(m->slots[i].key);
+            lval_del(m->slots[i].val);
+        }
+    }
+    free(m->slots);
+    free(m);
+}
+
+/* Slot holding key k with hash h, or the empty slot where it would go */
+static int lmap_slot_of(lmap *m, lval *k, uint64_t h) {
+    int i = h & (m->cap - 1);
+    while (m->slots[i].key &&
+           (m->slots[i].hash != h || !lmap_key_eq(m->slots[i].key, k))) {
+        i = (i + 1) & (m->cap - 1);
+    }
+    return i;
+}
+
+static void lmap_grow(lmap *m) {
+    lmap_slot *old = m->slots;
+    int cap = m->cap;
+
+    m->cap = cap ? cap * 2 : 8;
+    m->slots = calloc(m->cap, sizeof(lmap_slot));
+
+    /* Reinsert existing entries into the larger table */
+    for (int i = 0; i < cap; i++) {
+        if (old[i].key) {
+            int j = old[i].hash & (m->cap - 1);
+            while (m->slots[j].key) {
+                j = (j + 1) & (m->cap - 1);
+            }
+            m->slots[j] = old[i];
+        }
+    }
+    free(old);
+}
+
+lval *lmap_get(lmap *m, lval *k) {
+    if (!m->count) {
+        return NULL;
+    }
+    int i = lmap_slot_of(m, k, lmap_hash(k));
+    return m->slots[i].key ? m->slots[i].val : NULL;
+}
+
+void lmap_put(lmap *m, lval *k, lval *v) {
+    /* Keep the load factor under three quarters */
+    if ((m->count + 1) * 4 > m->cap * 3) {
+        lmap_grow(m);
+    }
+
+    uint64_t h = lmap_hash(k);
+    int i = lmap_slot_of(m, k, h);
+
+    /* If the key is already there replace its value */
+    if (m->slots[i].key) {
+        lval_del(k);
+        lval_del(m->slots[i].val);
+        m->slots[i].val = v;
+        return;
+    }
+
+    m->slots[i].hash = h;
+    m->slots[i].key = k;
+    m->slots[i].val = v;
+    m->count++;
+}
+
+int lmap_remove(lmap *m, lval *k) {
+    if (!m->count) {
+        return 0;
+    }
+    int mask = m->cap - 1;
+    int i = lmap_slot_of(m, k, lmap_hash(k));
+    if (!m->slots[i].key) {
+        return 0;
+    }
+
+    lval_del(m->slots[i].key);
+    lval_del(m->slots[i].val);
+    m->count--;
+
+    /* Shift back each later entry of the run which could sit in the hole,
+       so every entry stays reachable from its home slot */
+    for (int j = (i + 1) & mask; m->slots[j].key; j = (j + 1) & mask) {
+        int home = m->slots[j].hash & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            m->slots[i] = m->slots[j];
+            i = j;
+        }
+    }
+    m->slots[i].key = NULL;
+
+    return 1;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "lval.h"
+#include <stdint.h>
+
+/* Hash table behind map values. Keys are numbers, strings or symbols and
+   are compared by value. Collisions are resolved by linear probing, and
+   removal shifts later entries back, so the table needs no tombstones. */
+typedef struct {
+    uint64_t hash;
+
+    /* NULL in an empty slot */
+    lval *key;
+    lval *val;
+} lmap_slot;
+
+struct lmap {
+    int count;
+    int cap;
+    lmap_slot *slots;
+};
+
+lmap *lmap_new(void);
+lmap *lmap_copy(lmap *m);
+void lmap_del(lmap *m);
+
+/* Can k be used as a key */
+int lmap_hashable(lval *k);
+
+/* Value of key k, not referenced for the caller, or NULL */
+lval *lmap_get(lmap *m, lval *k);
+
+/* Bind key k to v, taking a reference to each */
+void lmap_put(lmap *m, lval *k, lval *v);
+
+/* Remove key k. Returns whether it was there. */
+int lmap_remove(lmap *m, lval *k);
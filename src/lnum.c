@@ -0,0 +1,303 @@
+#include "lnum.h"
+#include "lval.h"
+
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(LNUM_SCALAR)
+#define LNUM_X86
+#include <immintrin.h>
+#endif
+
+/* Portable loops. Arithmetic is done unsigned so overflow wraps. */
+
+static long lnum_add1(long x, long y) {
+    return (long)((unsigned long)x + (unsigned long)y);
+}
+
+static long lnum_mul1(long x, long y) {
+    return (long)((unsigned long)x * (unsigned long)y);
+}
+
+static void lnum_elem_scalar(long *r, long *x, long *y, size_t n, int op) {
+    switch (op) {
+    case LOP_ADD:
+        for (size_t i = 0; i < n; i++) {
+            r[i] = lnum_add1(x[i], y[i]);
+        }
+        break;
+    case LOP_SUB:
+        for (size_t i = 0; i < n; i++) {
+            r[i] = (long)((unsigned long)x[i] - (unsigned long)y[i]);
+        }
+        break;
+    case LOP_MUL:
+        for (size_t i = 0; i < n; i++) {
+            r[i] = lnum_mul1(x[i], y[i]);
+        }
+        break;
+    case LOP_GT:
+        for (size_t i = 0; i < n; i++) {
+            r[i] = x[i] > y[i];
+        }
+        break;
+    case LOP_LT:
+        for (size_t i = 0; i < n; i++) {
+            r[i] = x[i] < y[i];
+        }
+        break;
+    case LOP_GE:
+        for (size_t i = 0; i < n; i++) {
+            r[i] = x[i] >= y[i];
+        }
+        break;
+    case LOP_LE:
+        for (size_t i = 0; i < n; i++) {
+            r[i] = x[i] <= y[i];
+        }
+        break;
+    case LOP_EQ:
+        for (size_t i = 0; i < n; i++) {
+            r[i] = x[i] == y[i];
+        }
+        break;
+    case LOP_NE:
+        for (size_t i = 0; i < n; i++) {
+            r[i] = x[i] != y[i];
+        }
+        break;
+    }
+}
+
+#ifdef LNUM_X86
+
+/* Each vector path handles a whole number of registers from the start of
+   the arrays and returns how many elements that was, leaving the rest to
+   the portable loops. */
+
+static int lnum_avx2 = -1;
+
+static int lnum_has_avx2(void) {
+    if (lnum_avx2 == -1) {
+        __builtin_cpu_init();
+        lnum_avx2 = __builtin_cpu_supports("avx2") != 0;
+    }
+    return lnum_avx2;
+}
+
+/* SSE2 is part of x86-64, so these need no check. It has no 64 bit
+   comparisons, so only arithmetic is done here. */
+
+/* Low 64 bits of each product, from 32 bit multiplies */
+static __m128i lnum_mul_sse2(__m128i a, __m128i b) {
+    __m128i lo = _mm_mul_epu32(a, b);
+    __m128i cross = _mm_add_epi64(_mm_mul_epu32(_mm_srli_epi64(a, 32), b),
+                                  _mm_mul_epu32(a, _mm_srli_epi64(b, 32)));
+    return _mm_add_epi64(lo, _mm_slli_epi64(cross, 32));
+}
+
+static size_t lnum_elem_sse2(long *r, long *x, long *y, size_t n, int op) {
+    if (op != LOP_ADD && op != LOP_SUB && op != LOP_MUL) {
+        return 0;
+    }
+
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128i a = _mm_loadu_si128((__m128i *)(x + i));
+        __m128i b = _mm_loadu_si128((__m128i *)(y + i));
+        __m128i c = op == LOP_ADD   ? _mm_add_epi64(a, b)
+                    : op == LOP_SUB ? _mm_sub_epi64(a, b)
+                                    : lnum_mul_sse2(a, b);
+        _mm_storeu_si128((__m128i *)(r + i), c);
+    }
+    return i;
+}
+
+static size_t lnum_sum_sse2(long *x, size_t n, long *sum) {
+    __m128i acc = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        acc = _mm_add_epi64(acc, _mm_loadu_si128((__m128i *)(x + i)));
+    }
+
+    long out[2];
+    _mm_storeu_si128((__m128i *)out, acc);
+    *sum = lnum_add1(out[0], out[1]);
+    return i;
+}
+
+static size_t lnum_dot_sse2(long *x, long *y, size_t n, long *dot) {
+    __m128i acc = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128i a = _mm_loadu_si128((__m128i *)(x + i));
+        __m128i b = _mm_loadu_si128((__m128i *)(y + i));
+        acc = _mm_add_epi64(acc, lnum_mul_sse2(a, b));
+    }
+
+    long out[2];
+    _mm_storeu_si128((__m128i *)out, acc);
+    *dot = lnum_add1(out[0], out[1]);
+    return i;
+}
+
+#define LNUM_AVX2 __attribute__((target("avx2")))
+
+LNUM_AVX2 static __m256i lnum_mul_avx2(__m256i a, __m256i b) {
+    __m256i lo = _mm256_mul_epu32(a, b);
+    __m256i cross =
+        _mm256_add_epi64(_mm256_mul_epu32(_mm256_srli_epi64(a, 32), b),
+                         _mm256_mul_epu32(a, _mm256_srli_epi64(b, 32)));
+    return _mm256_add_epi64(lo, _mm256_slli_epi64(cross, 32));
+}
+
+/* Sum of the four lanes of a */
+LNUM_AVX2 static long lnum_hsum_avx2(__m256i a) {
+    long out[4];
+    _mm256_storeu_si256((__m256i *)out, a);
+    return lnum_add1(lnum_add1(out[0], out[1]), lnum_add1(out[2], out[3]));
+}
+
+LNUM_AVX2 static size_t lnum_elem_avx2(long *r, long *x, long *y, size_t n,
+                                       int op) {
+    __m256i one = _mm256_set1_epi64x(1);
+
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i a = _mm256_loadu_si256((__m256i *)(x + i));
+        __m256i b = _mm256_loadu_si256((__m256i *)(y + i));
+        __m256i c;
+
+        /* Comparisons give all ones for true, masked down to 1 */
+        switch (op) {
+        case LOP_ADD:
+            c = _mm256_add_epi64(a, b);
+            break;
+        case LOP_SUB:
+            c = _mm256_sub_epi64(a, b);
+            break;
+        case LOP_MUL:
+            c = lnum_mul_avx2(a, b);
+            break;
+        case LOP_GT:
+            c = _mm256_and_si256(_mm256_cmpgt_epi64(a, b), one);
+            break;
+        case LOP_LT:
+            c = _mm256_and_si256(_mm256_cmpgt_epi64(b, a), one);
+            break;
+        case LOP_GE:
+            c = _mm256_andnot_si256(_mm256_cmpgt_epi64(b, a), one);
+            break;
+        case LOP_LE:
+            c = _mm256_andnot_si256(_mm256_cmpgt_epi64(a, b), one);
+            break;
+        case LOP_EQ:
+            c = _mm256_and_si256(_mm256_cmpeq_epi64(a, b), one);
+            break;
+        default:
+            c = _mm256_andnot_si256(_mm256_cmpeq_epi64(a, b), one);
+            break;
+        }
+        _mm256_storeu_si256((__m256i *)(r + i), c);
+    }
+    return i;
+}
+
+LNUM_AVX2 static size_t lnum_sum_avx2(long *x, size_t n, long *sum) {
+    __m256i acc = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        acc = _mm256_add_epi64(acc, _mm256_loadu_si256((__m256i *)(x + i)));
+    }
+    *sum = lnum_hsum_avx2(acc);
+    return i;
+}
+
+LNUM_AVX2 static size_t lnum_dot_avx2(long *x, long *y, size_t n, long *dot) {
+    __m256i acc = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i a = _mm256_loadu_si256((__m256i *)(x + i));
+        __m256i b = _mm256_loadu_si256((__m256i *)(y + i));
+        acc = _mm256_add_epi64(acc, lnum_mul_avx2(a, b));
+    }
+    *dot = lnum_hsum_avx2(acc);
+    return i;
+}
+
+/* Smallest, or with max set largest, of the first elements of x. Only
+   called with at least four. */
+LNUM_AVX2 static size_t lnum_extreme_avx2(long *x, size_t n, int max,
+                                          long *out) {
+    __m256i acc = _mm256_loadu_si256((__m256i *)x);
+    size_t i = 4;
+    for (; i + 4 <= n; i += 4) {
+        __m256i a = _mm256_loadu_si256((__m256i *)(x + i));
+        __m256i gt = max ? _mm256_cmpgt_epi64(a, acc)
+                         : _mm256_cmpgt_epi64(acc, a);
+        acc = _mm256_blendv_epi8(acc, a, gt);
+    }
+
+    long lanes[4];
+    _mm256_storeu_si256((__m256i *)lanes, acc);
+    *out = lanes[0];
+    for (int j = 1; j < 4; j++) {
+        if (max ? lanes[j] > *out : lanes[j] < *out) {
+            *out = lanes[j];
+        }
+    }
+    return i;
+}
+
+#endif
+
+void lnum_elem(long *r, long *x, long *y, size_t n, int op) {
+    size_t i = 0;
+#ifdef LNUM_X86
+    i = lnum_has_avx2() ? lnum_elem_avx2(r, x, y, n, op)
+                        : lnum_elem_sse2(r, x, y, n, op);
+#endif
+    lnum_elem_scalar(r + i, x + i, y + i, n - i, op);
+}
+
+long lnum_sum(long *x, size_t n) {
+    long sum = 0;
+    size_t i = 0;
+#ifdef LNUM_X86
+    i = lnum_has_avx2() ? lnum_sum_avx2(x, n, &sum)
+                        : lnum_sum_sse2(x, n, &sum);
+#endif
+    for (; i < n; i++) {
+        sum = lnum_add1(sum, x[i]);
+    }
+    return sum;
+}
+
+long lnum_dot(long *x, long *y, size_t n) {
+    long dot = 0;
+    size_t i = 0;
+#ifdef LNUM_X86
+    i = lnum_has_avx2() ? lnum_dot_avx2(x, y, n, &dot)
+                        : lnum_dot_sse2(x, y, n, &dot);
+#endif
+    for (; i < n; i++) {
+        dot = lnum_add1(dot, lnum_mul1(x[i], y[i]));
+    }
+    return dot;
+}
+
+static long lnum_extreme(long *x, size_t n, int max) {
+    long out = x[0];
+    size_t i = 1;
+#ifdef LNUM_X86
+    if (n >= 4 && lnum_has_avx2()) {
+        i = lnum_extreme_avx2(x, n, max, &out);
+    }
+#endif
+    for (; i < n; i++) {
+        if (max ? x[i] > out : x[i] < out) {
+            out = x[i];
+        }
+    }
+    return out;
+}
+
+long lnum_min(long *x, size_t n) { return lnum_extreme(x, n, 0); }
+long lnum_max(long *x, size_t n) { return lnum_extreme(x, n, 1); }
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stddef.h>
+
+/* Kernels over arrays of numbers, for the bulk vector builtins. Results
+   wrap around on overflow, as they would in the registers.
+
+   On x86-64 each kernel picks an AVX2 or SSE2 path when the processor has
+   it, and finishes the elements left over with the portable loop. Build
+   with -DLNUM_SCALAR to use only the portable loops. */
+
+/* Set r[i] to x[i] op y[i] for each of the n elements. op is LOP_ADD,
+   LOP_SUB, LOP_MUL or a comparison, which gives 1 or 0. */
+void lnum_elem(long *r, long *x, long *y, size_t n, int op);
+
+long lnum_sum(long *x, size_t n);
+long lnum_dot(long *x, long *y, size_t n);
+
+/* Smallest and largest of n elements, n at least 1 */
+long lnum_min(long *x, size_t n);
+long lnum_max(long *x, size_t n);
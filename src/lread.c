@@ -0,0 +1,422 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "lread.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Initial size of the buffer for reading a stream */
+#ifndef LREAD_BUF
+#define LREAD_BUF (64 * 1024)
+#endif
+
+void lread_init(lreader *r, char *name, char *s, size_t len) {
+    r->name = name;
+    r->buf = s;
+    r->s = s;
+    r->end = s + len;
+    r->base = 0;
+    r->line = 1;
+    r->line_off = 0;
+    r->fd = -1;
+    r->cap = 0;
+    r->map = 0;
+    r->err = NULL;
+}
+
+/* Has everything there is to read been read into the buffer */
+static int lread_eof(lreader *r) { return r->fd == -1; }
+
+/* Read more of the stream, keeping the form from s onwards */
+static void lread_fill(lreader *r) {
+    size_t keep = r->end - r->s;
+
+    r->base += r->s - r->buf;
+    memmove(r->buf, r->s, keep);
+    if (keep == r->cap) {
+        r->cap *= 2;
+        r->buf = realloc(r->buf, r->cap);
+    }
+    r->s = r->buf;
+    r->end = r->buf + keep;
+
+    ssize_t n = read(r->fd, r->end, r->cap - keep);
+    if (n > 0) {
+        r->end += n;
+        return;
+    }
+
+    /* Whatever is left is all there is */
+    if (n == -1) {
+        r->err = lval_err("%s: error: Unable to read file!", r->name);
+    }
+    if (r->fd != STDIN_FILENO) {
+        close(r->fd);
+    }
+    r->fd = -1;
+}
+
+/* Report a syntax error at s. At the end of what has been read so far
+   more of the stream is needed instead, which is signalled by returning
+   NULL without an error. */
+static lval *lread_error(lreader *r, char *what) {
+    if (r->s == r->end && !lread_eof(r)) {
+        return NULL;
+    }
+
+    size_t col = r->base + (r->s - r->buf) - r->line_off;
+    r->err = lval_err("%s:%i:%i: error: %s", r->name, r->line, (int)col + 1,
+                      what);
+    return NULL;
+}
+
+static void lread_newline(lreader *r) {
+    r->line++;
+    r->line_off = r->base + (r->s - r->buf) + 1;
+}
+
+/* Skip whitespace and comments */
+static void lread_space(lreader *r) {
+    while (r->s < r->end) {
+        switch (*r->s) {
+        case '\n':
+            lread_newline(r);
+            /* fallthrough */
+        case ' ':
+        case '\t':
+        case '\r':
+        case '\f':
+        case '\v':
+            r->s++;
+            break;
+
+        /* Comments run to the end of the line */
+        case ';':
+            while (r->s < r->end && *r->s != '\n' && *r->s != '\r') {
+                r->s++;
+            }
+            break;
+
+        default:
+            return;
+        }
+    }
+}
+
+static int lread_is_digit(char c) { return c >= '0' && c <= '9'; }
+
+static int lread_is_sym(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+           lread_is_digit(c) || (c && strchr("_+-*/\\=<>!&", c));
+}
+
+static lval *lread_num(lreader *r) {
+    int neg = *r->s == '-';
+    if (neg) {
+        r->s++;
+    }
+
+    /* Accumulate the magnitude, noting if it does not fit in a long */
+    unsigned long limit = neg ? (unsigned long)LONG_MAX + 1 : LONG_MAX;
+    unsigned long n = 0;
+    int over = 0;
+    while (r->s < r->end && lread_is_digit(*r->s)) {
+        unsigned long d = *r->s++ - '0';
+        if (n > (limit - d) / 10) {
+            over = 1;
+        } else {
+            n = n * 10 + d;
+        }
+    }
+
+    /* The number may go on in what has not been read yet */
+    if (r->s == r->end && !lread_eof(r)) {
+        return NULL;
+    }
+
+    if (over) {
+        return lval_err("Invalid Number");
+    }
+    if (neg && n) {
+        return lval_num(-(long)(n - 1) - 1);
+    }
+    return lval_num((long)n);
+}
+
+static lval *lread_sym(lreader *r) {
+    char *start = r->s;
+    while (r->s < r->end && lread_is_sym(*r->s)) {
+        r->s++;
+    }
+
+    /* The symbol may go on in what has not been read yet */
+    if (r->s == r->end && !lread_eof(r)) {
+        return NULL;
+    }
+
+    return lval_sym_len(start, r->s - start);
+}
+
+/* Escape sequences in strings and the characters they stand for */
+static const char lread_esc_in[] = "abfnrtv\\'\"0";
+static const char lread_esc_out[] = "\a\b\f\n\r\t\v\\'\"\0";
+
+static lval *lread_str(lreader *r) {
+    /* Find the closing quote. A backslash escapes any character. */
+    char *start = ++r->s;
+    while (r->s < r->end && *r->s != '"') {
+        if (*r->s == '\\' && r->s + 1 < r->end) {
+            r->s++;
+        }
+        if (*r->s == '\n') {
+            lread_newline(r);
+        }
+        r->s++;
+    }
+    if (r->s == r->end) {
+        return lread_error(r, "expected '\"'");
+    }
+
+    /* Unescaping never makes the string longer */
+    char *str = malloc(r->s - start + 1);
+    char *out = str;
+    for (char *p = start; p < r->s; p++) {
+        char *esc = *p == '\\' && p[1] ? strchr(lread_esc_in, p[1]) : NULL;
+        if (esc) {
+            *out++ = lread_esc_out[esc - lread_esc_in];
+            p++;
+        } else {
+            *out++ = *p;
+        }
+    }
+    *out = '\0';
+    r->s++;
+
+    lval *v = lval_str(str);
+    free(str);
+
+    return v;
+}
+
+static lval *lread_expr(lreader *r);
+
+static lval *lread_list(lreader *r, lval *x, char close) {
+    r->s++;
+    while (1) {
+        lread_space(r);
+        if (r->s == r->end) {
+            lval_del(x);
+            return lread_error(r, close == ')' ? "expected ')'"
+                                               : "expected '}'");
+        }
+        if (*r->s == close) {
+            r->s++;
+            return x;
+        }
+
+        lval *y = lread_expr(r);
+        if (!y) {
+            lval_del(x);
+            return NULL;
+        }
+        lval_add(x, y);
+    }
+}
+
+static lval *lread_expr(lreader *r) {
+    char c = *r->s;
+
+    /* Numbers are tried before symbols, so "-1" is a number and "-" or
+       "-x" a symbol */
+    if (lread_is_digit(c) ||
+        (c == '-' && r->s + 1 < r->end && lread_is_digit(r->s[1]))) {
+        return lread_num(r);
+    }
+    if (lread_is_sym(c)) {
+        return lread_sym(r);
+    }
+
+    switch (c) {
+    case '"':
+        return lread_str(r);
+    case '(':
+        return lread_list(r, lval_sexpr(), ')');
+    case '{':
+        return lread_list(r, lval_qexpr(), '}');
+    }
+
+    char what[32];
+    snprintf(what, sizeof(what), "unexpected '%c'", c);
+    return lread_error(r, what);
+}
+
+/* Where a scan of a form that runs past what has been read got to: the
+   offset from s, the depth of open lists and whether it is in a string or
+   a comment */
+typedef struct {
+    size_t pos;
+    int depth;
+    char in;
+} lscan;
+
+/* Scan on through the form from where the last scan stopped, without
+   building anything. Returns 1 once the form may have ended, so that it is
+   only read again then rather than after every read of the stream. */
+static int lread_scan(lreader *r, lscan *sc) {
+    size_t len = r->end - r->s;
+    while (sc->pos < len) {
+        char c = r->s[sc->pos++];
+
+        if (sc->in == '"') {
+            if (c == '\\') {
+                /* The escaped character may not have been read yet */
+                if (sc->pos == len) {
+                    sc->pos--;
+                    return 0;
+                }
+                sc->pos++;
+            } else if (c == '"') {
+                sc->in = 0;
+                if (sc->depth == 0) {
+                    return 1;
+                }
+            }
+            continue;
+        }
+        if (sc->in == ';') {
+            if (c == '\n' || c == '\r') {
+                sc->in = 0;
+            }
+            continue;
+        }
+
+        switch (c) {
+        case '"':
+        case ';':
+            sc->in = c;
+            break;
+        case '(':
+        case '{':
+            sc->depth++;
+            break;
+        case ')':
+        case '}':
+            if (--sc->depth <= 0) {
+                return 1;
+            }
+            break;
+        default:
+            /* A number or symbol on its own ends with what follows it */
+            if (sc->depth == 0 && !lread_is_sym(c)) {
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+lval *lread_next(lreader *r) {
+    lscan sc = {0, 0, 0};
+
+    while (!r->err) {
+        /* Where to start again if the form runs past what has been read */
+        char *start = r->s;
+        int line = r->line;
+        size_t line_off = r->line_off;
+
+        lread_space(r);
+        if (r->s == r->end && lread_eof(r)) {
+            return NULL;
+        }
+        size_t skip = r->s - start;
+
+        lval *x = r->s < r->end ? lread_expr(r) : NULL;
+        if (x || r->err) {
+            return x;
+        }
+
+        /* Read more until the form may have ended, then parse it again
+           from its start. Scanning only what is new keeps a form that
+           spans many reads from being parsed again after each of them. */
+        r->s = start;
+        r->line = line;
+        r->line_off = line_off;
+        if (sc.pos < skip) {
+            sc.pos = skip;
+        }
+        do {
+            lread_fill(r);
+        } while (!lread_eof(r) && !r->err && !lread_scan(r, &sc));
+    }
+
+    return NULL;
+}
+
+lval *lread_all(lreader *r) {
+    lval *x = lval_sexpr();
+
+    lval *y;
+    while ((y = lread_next(r))) {
+        lval_add(x, y);
+    }
+
+    if (r->err) {
+        lval_del(x);
+        x = r->err;
+        r->err = NULL;
+    }
+
+    return x;
+}
+
+lval *lread_open(lreader *r, char *name) {
+    int fd = strcmp(name, "-") == 0 ? STDIN_FILENO : open(name, O_RDONLY);
+    if (fd == -1) {
+        return lval_err("%s: error: Unable to open file!", name);
+    }
+
+    /* A regular file is read straight from the page cache */
+    struct stat st;
+    if (fd != STDIN_FILENO && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+        st.st_size > 0) {
+        char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            close(fd);
+            posix_madvise(map, st.st_size, POSIX_MADV_SEQUENTIAL);
+            lread_init(r, name, map, st.st_size);
+            r->map = st.st_size;
+            return NULL;
+        }
+    }
+
+    /* Anything else, such as a pipe, is read a buffer at a time */
+    lread_init(r, name, NULL, 0);
+    r->cap = LREAD_BUF;
+    r->buf = malloc(r->cap);
+    r->s = r->buf;
+    r->end = r->buf;
+    r->fd = fd;
+
+    return NULL;
+}
+
+void lread_close(lreader *r) {
+    if (r->map) {
+        munmap(r->buf, r->map);
+    }
+    if (r->cap) {
+        free(r->buf);
+    }
+    if (r->fd != -1 && r->fd != STDIN_FILENO) {
+        close(r->fd);
+    }
+    if (r->err) {
+        lval_del(r->err);
+    }
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "lval.h"
+#include <stddef.h>
+
+/* Reader for Lispy source. Values are built in a single pass straight from
+   the text, with no syntax tree in between. Symbols are interned from the
+   text where they stand and only strings are copied out of it.
+
+   A reader over a stream holds only the form being read. When a form runs
+   past the end of the buffer, more is read until the form may have ended,
+   which is found by scanning only the new text, and the form is then read
+   again. */
+typedef struct {
+    /* Name of the source, for error messages */
+    char *name;
+
+    /* Text read so far and the part of it still to read */
+    char *buf;
+    char *s;
+    char *end;
+
+    /* Offset of buf in the whole text */
+    size_t base;
+
+    /* Line of s and offset of its start, for error messages */
+    int line;
+    size_t line_off;
+
+    /* Stream to read more from, or -1 once it is all in buf */
+    int fd;
+
+    /* Size of buf when it is allocated or mapped by the reader */
+    size_t cap;
+    size_t map;
+
+    /* Syntax error, once one has been found */
+    lval *err;
+} lreader;
+
+void lread_init(lreader *r, char *name, char *s, size_t len);
+
+/* Read the next expression. Returns NULL at the end of the text, or on a
+   syntax error which is then left in r->err. */
+lval *lread_next(lreader *r);
+
+/* Read every expression into an S-Expression, or return the syntax error */
+lval *lread_all(lreader *r);
+
+/* Open the named file, or stdin for "-", to read a form at a time. Returns
+   an error if it cannot be opened, otherwise NULL. */
+lval *lread_open(lreader *r, char *name);
+void lread_close(lreader *r);
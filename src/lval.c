@@ -1,46 +1,52 @@
 #include "lval.h"
+#include "lalloc.h"
+#include "lcache.h"
+#include "lgc.h"
+#include "lmap.h"
+#include "lnum.h"
+#include "lread.h"
 #include "mpc.h"
+#include "sym.h"
+#include "vm.h"
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 
-extern mpc_parser_t *Number;
-extern mpc_parser_t *Symbol;
-extern mpc_parser_t *String;
-extern mpc_parser_t *Comment;
-extern mpc_parser_t *Sexpr;
-extern mpc_parser_t *Qexpr;
-extern mpc_parser_t *Expr;
-extern mpc_parser_t *Lispy;
-
 lval *lval_num(long x);
 lval *lval_err(char *fmt, ...);
+lval *lval_err_shared(char *msg);
 lval *lval_sym(char *s);
+lval *lval_sym_len(char *s, size_t n);
 lval *lval_sexpr(void);
 lval *lval_qexpr(void);
-lval *lval_lambda(lval *formals, lval *body);
+lval *lval_vec(void);
+lval *lval_map(void);
+lval *lval_lambda(lenv *e, lval *formals, lval *body);
 lval *lval_str(char *s);
 
-lval *lval_read_num(mpc_ast_t *t);
-lval *lval_read_str(mpc_ast_t *t);
-
 lval *lval_add(lval *v, lval *x);
 lval *lval_join(lval *x, lval *y);
 
 void lval_print(lval *v);
 void lval_print_str(lval *v);
 void lval_expr_print(lval *v, char open, char close);
+void lval_map_print(lval *v);
 
 lval *lval_take(lval *v, int i);
 lval *lval_pop(lval *v, int i);
 lval *lval_call(lenv *e, lval *f, lval *a);
+lval *lval_call_sexpr(lenv *e, lval *v);
+lval *lval_bind(lval *f, lval *a);
+static lval *lval_eval_frame(lenv *e, lval *f, lval *v, int code);
 
 char *ltype_name(int t);
 
 int lval_eq(lval *x, lval *y);
 
-lval *builtin_op(lenv *e, lval *a, char *op);
+lval *builtin_op(lenv *e, lval *a, int op);
+lval *builtin_op_argv(lenv *e, int argc, lval **argv, int op);
 lval *builtin_head(lenv *e, lval *a);
 lval *builtin_tail(lenv *e, lval *a);
 lval *builtin_list(lenv *e, lval *a);
@@ -51,8 +57,44 @@ lval *builtin_put(lenv *e, lval *a);
 lval *builtin_var(lenv *e, lval *a, char *func);
 lval *builtin_lambda(lenv *e, lval *a);
 lval *builtin_if(lenv *e, lval *a);
+lval *builtin_let(lenv *e, lval *a);
 lval *builtin_load(lenv *e, lval *a);
 
+/* Vector functions */
+lval *builtin_vec(lenv *e, lval *a);
+lval *builtin_nth(lenv *e, lval *a);
+lval *builtin_len(lenv *e, lval *a);
+lval *builtin_set(lenv *e, lval *a);
+lval *builtin_slice(lenv *e, lval *a);
+lval *builtin_push(lenv *e, lval *a);
+
+/* Map functions */
+lval *builtin_hash_map(lenv *e, lval *a);
+lval *builtin_get(lenv *e, lval *a);
+lval *builtin_map_put(lenv *e, lval *a);
+lval *builtin_remove(lenv *e, lval *a);
+lval *builtin_keys(lenv *e, lval *a);
+
+/* Bulk numeric functions over vectors */
+lval *builtin_vop(lenv *e, lval *a, int op);
+lval *builtin_vadd(lenv *e, lval *a);
+lval *builtin_vsub(lenv *e, lval *a);
+lval *builtin_vmul(lenv *e, lval *a);
+lval *builtin_vgt(lenv *e, lval *a);
+lval *builtin_vlt(lenv *e, lval *a);
+lval *builtin_vge(lenv *e, lval *a);
+lval *builtin_vle(lenv *e, lval *a);
+lval *builtin_veq(lenv *e, lval *a);
+lval *builtin_vne(lenv *e, lval *a);
+lval *builtin_vsum(lenv *e, lval *a);
+lval *builtin_vmin(lenv *e, lval *a);
+lval *builtin_vmax(lenv *e, lval *a);
+lval *builtin_vdot(lenv *e, lval *a);
+
+lval *builtin_eval_expr(lval *a);
+lval *builtin_if_expr(lval *a);
+lval *builtin_let_frame(lenv *e, lval *a);
+
 /* Comparison functions */
 lval *builtin_gt(lenv *e, lval *a);
 lval *builtin_lt(lenv *e, lval *a);
@@ -60,14 +102,21 @@ lval *builtin_ge(lenv *e, lval *a);
 lval *builtin_le(lenv *e, lval *a);
 lval *builtin_eq(lenv *e, lval *a);
 lval *builtin_ne(lenv *e, lval *a);
-
-lval *builtin_ord(lenv *e, lval *a, char *op);
-lval *builtin_cmp(lenv *e, lval *a, char *op);
+lval *builtin_gt_argv(lenv *e, int argc, lval **argv);
+lval *builtin_lt_argv(lenv *e, int argc, lval **argv);
+lval *builtin_ge_argv(lenv *e, int argc, lval **argv);
+lval *builtin_le_argv(lenv *e, int argc, lval **argv);
+lval *builtin_eq_argv(lenv *e, int argc, lval **argv);
+lval *builtin_ne_argv(lenv *e, int argc, lval **argv);
+
+lval *builtin_ord(lenv *e, lval *a, int op);
+lval *builtin_cmp(lenv *e, lval *a, int op);
+lval *builtin_ord_argv(lenv *e, int argc, lval **argv, int op);
+lval *builtin_cmp_argv(lenv *e, int argc, lval **argv, int op);
 
 lval *builtin(lenv *e, lval *a, char *func);
 
 lval *lenv_get(lenv *e, lval *k);
-lenv *lenv_copy(lenv *e);
 void lenv_def(lenv *e, lval *k, lval *v);
 
 #define LASSERT(args, cond, fmt, ...)                                          \
@@ -77,104 +126,258 @@ void lenv_def(lenv *e, lval *k, lval *v);
         return err;                                                            \
     }
 
+/* As LASSERT, for a constant message whose error is made once and shared */
+#define LASSERT_SHARED(args, cond, msg)                                        \
+    if (!(cond)) {                                                             \
+        lval *err = lval_err_shared(msg);                                      \
+        lval_del(args);                                                        \
+        return err;                                                            \
+    }
+
 #define LASSERT_NUM(name, args, arg_num)                                       \
     LASSERT(args, args->count == arg_num,                                      \
             "Function '%s' must be called with %i arguments", name, arg_num);
 
 #define LASSERT_TYPE(name, args, arg_idx, arg_type)                            \
     LASSERT(args, args->cell[arg_idx]->type == arg_type,                       \
-            "Function '%i' passed incorrect type for argument %i. "            \
+            "Function '%s' passed incorrect type for argument %i. "            \
             "Got %s, expected %s",                                             \
-            ltype_name(a->cell[arg_idx]->type), ltype_name(arg_type));
+            name, arg_idx, ltype_name(args->cell[arg_idx]->type),              \
+            ltype_name(arg_type));
 
 #define LASSERT_EMPTY(args)                                                    \
-    LASSERT(args, args->count != 0, "Function called with empty list")
+    LASSERT_SHARED(args, args->count != 0, "Function called with empty list")
+
+#define LASSERT_SEQ(name, args, arg_idx)                                       \
+    LASSERT(args,                                                              \
+            args->cell[arg_idx]->type == LVAL_QEXPR ||                         \
+                args->cell[arg_idx]->type == LVAL_VEC,                         \
+            "Function '%s' passed incorrect type for argument %i. "            \
+            "Got %s, expected %s or %s",                                       \
+            name, arg_idx, ltype_name(args->cell[arg_idx]->type),              \
+            ltype_name(LVAL_QEXPR), ltype_name(LVAL_VEC));
+
+#define LASSERT_KEY(name, args, arg_idx)                                       \
+    LASSERT(args, lmap_hashable(args->cell[arg_idx]),                          \
+            "Function '%s' passed %s as a key. Keys must be numbers, "         \
+            "strings or symbols",                                              \
+            name, ltype_name(args->cell[arg_idx]->type));
+
+#define LASSERT_INDEX(name, args, index, count)                                \
+    LASSERT(args, (index) >= 0 && (index) < (count),                           \
+            "Function '%s' passed index %li out of range for length %i",       \
+            name, (long)(index), (count));
+
+/* Small numbers are shared rather than allocated each time */
+#define LVAL_NUM_SHARED_MIN -128
+#define LVAL_NUM_SHARED_MAX 1023
+
+static lval *lval_num_shared[LVAL_NUM_SHARED_MAX - LVAL_NUM_SHARED_MIN + 1];
 
 lval *lval_num(long x) {
-    lval *v = malloc(sizeof(lval));
+    lval **shared = NULL;
+    if (x >= LVAL_NUM_SHARED_MIN && x <= LVAL_NUM_SHARED_MAX) {
+        shared = &lval_num_shared[x - LVAL_NUM_SHARED_MIN];
+        if (*shared) {
+            return lval_ref(*shared);
+        }
+    }
+
+    lval *v = lval_alloc();
+    v->refs = 1;
     v->type = LVAL_NUM;
     v->num = x;
 
+    /* The table keeps its own reference, so shared numbers live forever */
+    if (shared) {
+        *shared = lval_ref(v);
+    }
+
     return v;
 }
 
-lval *lval_err(char *fmt, ...) {
-    lval *v = malloc(sizeof(lval));
+/* Error holding a copy of the message msg */
+static lval *lval_err_msg(char *msg) {
+    lval *v = lval_alloc();
+    v->refs = 1;
     v->type = LVAL_ERR;
+    v->err = malloc(strlen(msg) + 1);
+    strcpy(v->err, msg);
+
+    return v;
+}
 
-    /* Create a va list and initialize it */
+lval *lval_err(char *fmt, ...) {
+    /* printf the error string with a maximum of 511 characters */
+    char msg[512];
     va_list va;
     va_start(va, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, va);
+    va_end(va);
 
-    /* Allocate 512 bytes of space */
-    v->err = malloc(512);
+    return lval_err_msg(msg);
+}
 
-    /* printf the eror string with a maximum of 511 characters */
-    vsnprintf(v->err, 511, fmt, va);
+/* Errors with a constant message, such as those of the common argument
+   checks, are made once and shared like small numbers. Messages holding
+   values from the call are made with lval_err instead, as there is no
+   bound on how many of them there are. The table never grows, and once it
+   is full further messages are not shared. */
+#define LVAL_ERR_SHARED 1024
+
+static lval *lval_err_table[LVAL_ERR_SHARED];
+static int lval_err_count = 0;
+
+lval *lval_err_shared(char *msg) {
+    /* FNV-1a */
+    unsigned long h = 14695981039346656037UL;
+    for (char *p = msg; *p; p++) {
+        h ^= (unsigned char)*p;
+        h *= 1099511628211UL;
+    }
 
-    /* Reallocate to number of bytes actually used*/
-    v->err = realloc(v->err, strlen(v->err) + 1);
+    int i = h & (LVAL_ERR_SHARED - 1);
+    while (lval_err_table[i]) {
+        if (strcmp(lval_err_table[i]->err, msg) == 0) {
+            return lval_ref(lval_err_table[i]);
+        }
+        i = (i + 1) & (LVAL_ERR_SHARED - 1);
+    }
 
-    /* Cleanup va list */
-    va_end(va);
+    /* The table keeps its own reference, so shared errors live forever */
+    lval *v = lval_err_msg(msg);
+    if (lval_err_count < LVAL_ERR_SHARED / 4 * 3) {
+        lval_err_table[i] = lval_ref(v);
+        lval_err_count++;
+    }
 
     return v;
 }
 
-lval *lval_sym(char *s) {
-    lval *v = malloc(sizeof(lval));
+lval *lval_sym(char *s) { return lval_sym_len(s, strlen(s)); }
+
+/* Symbol named by the n characters at s */
+lval *lval_sym_len(char *s, size_t n) {
+    /* Every symbol has a single shared lval stored with its name */
+    char *name = sym_intern_len(s, n);
+    lval **shared = (lval **)sym_data(name);
+    if (*shared) {
+        return lval_ref(*shared);
+    }
+
+    lval *v = lval_alloc();
+    v->refs = 1;
     v->type = LVAL_SYM;
-    v->sym = malloc(strlen(s) + 1);
-    strcpy(v->sym, s);
+    v->sym = name;
+
+    /* The symbol table keeps its own reference */
+    *shared = lval_ref(v);
 
     return v;
 }
 
 lval *lval_fun(lbuiltin func) {
-    lval *v = malloc(sizeof(lval));
+    lval *v = lval_alloc();
+    v->refs = 1;
     v->type = LVAL_FUN;
     v->builtin = func;
+    v->call = lbuiltin_call(func);
 
     return v;
 }
 
-lval *lval_lambda(lval *formals, lval *body) {
-    lval *v = malloc(sizeof(lval));
+lval *lval_lambda(lenv *e, lval *formals, lval *body) {
+    lval *v = lval_alloc();
+    v->refs = 1;
     v->type = LVAL_FUN;
 
     /* Set Builtin to NULL */
     v->builtin = NULL;
 
-    /* Build new environment */
-    v->env = lenv_new();
+    /* Close over the environment the lambda is made in */
+    v->lambda = llambda_alloc();
+    v->lambda->env = lenv_ref(e);
 
     /* Set Formals and Body */
-    v->formals = formals;
-    v->body = body;
+    v->lambda->formals = formals;
+    v->lambda->body = body;
+    v->lambda->code = NULL;
 
     return v;
 }
 
 lval *lval_sexpr(void) {
-    lval *v = malloc(sizeof(lval));
-
+    lval *v = lval_alloc();
+    v->refs = 1;
     v->type = LVAL_SEXPR;
     v->count = 0;
+    v->off = 0;
     v->cell = NULL;
 
     return v;
 }
 
 lval *lval_qexpr(void) {
-    lval *v = malloc(sizeof(lval));
+    lval *v = lval_alloc();
+    v->refs = 1;
     v->type = LVAL_QEXPR;
     v->count = 0;
+    v->off = 0;
     v->cell = NULL;
 
     return v;
 }
 
-void lval_del(lval *v) {
+lval *lval_vec(void) {
+    lval *v = lval_alloc();
+    v->refs = 1;
+    v->type = LVAL_VEC;
+    v->count = 0;
+    v->off = 0;
+    v->cell = NULL;
+
+    return v;
+}
+
+lval *lval_map(void) {
+    lval *v = lval_alloc();
+    v->refs = 1;
+    v->type = LVAL_MAP;
+    v->map = lmap_new();
+
+    return v;
+}
+
+/* Block of cells shared between views of a list. Every cell in
+   items[first, used) holds a reference. */
+typedef struct {
+    int refs;
+    int pass;
+    int cap;
+    int first;
+    int used;
+    lval *items[];
+} lcells;
+
+static lcells *lval_cells(lval *v) {
+    if (!v->cell) {
+        return NULL;
+    }
+    return (lcells *)((char *)(v->cell - v->off) - offsetof(lcells, items));
+}
+
+static void lcells_del(lcells *b) {
+    if (!b || --b->refs > 0) {
+        return;
+    }
+    for (int i = b->first; i < b->used; i++) {
+        lval_del(b->items[i]);
+    }
+    free(b);
+}
+
+/* Release everything v holds, leaving the node itself */
+static void lval_release(lval *v) {
     switch (v->type) {
     /* Do nothing special for number type */
     case LVAL_NUM:
@@ -184,8 +387,8 @@ void lval_del(lval *v) {
     case LVAL_ERR:
         free(v->err);
         break;
+    /* Symbol names are interned and never freed */
     case LVAL_SYM:
-        free(v->sym);
         break;
 
     case LVAL_STR:
@@ -194,108 +397,158 @@ void lval_del(lval *v) {
 
     case LVAL_FUN:
         if (!v->builtin) {
-            lenv_del(v->env);
-            lval_del(v->formals);
-            lval_del(v->body);
+            lenv_del(v->lambda->env);
+            lval_del(v->lambda->formals);
+            lval_del(v->lambda->body);
+            lcode_del(v->lambda->code);
+            llambda_free(v->lambda);
         }
         break;
 
-    /* If Qexpr or Sexpr then delete all elements inside */
+    /* If Qexpr, Sexpr or Vector then release the cells */
     case LVAL_QEXPR:
     case LVAL_SEXPR:
-        for (int i = 0; i < v->count; i++) {
-            lval_del(v->cell[i]);
-        }
-        free(v->cell);
+    case LVAL_VEC:
+        lcells_del(lval_cells(v));
         break;
-    }
-}
 
-lval *lval_read_num(mpc_ast_t *t) {
-    errno = 0;
-    long x = strtol(t->contents, NULL, 10);
-    return errno != ERANGE ? lval_num(x) : lval_err("Invalid Number");
+    case LVAL_MAP:
+        lmap_del(v->map);
+        break;
+    }
 }
 
-lval *lval_read_str(mpc_ast_t *t) {
-    /* Cut off the final quote character */
-    t->contents[strlen(t->contents) - 1] = '\0';
+void lval_del(lval *v) {
+    /* Only free once the last reference goes away */
+    if (--v->refs > 0) {
+        return;
+    }
 
-    /* Copy the string missing out the first quote character */
-    char *unescaped = malloc(strlen(t->contents + 1) + 1);
-    strcpy(unescaped, t->contents + 1);
+    lval_release(v);
+    lval_free(v);
+}
 
-    /* Pass through the unescape function */
-    unescaped = mpcf_unescape(unescaped);
+/* Empty a value the collector found unreachable. Its references to other
+   unreachable values are dropped here, before any of them is freed. */
+void lval_clear(lval *v) {
+    lval_release(v);
+    v->type = LVAL_NUM;
+    v->num = 0;
+}
 
-    /* Construct a new lval using the string */
-    lval *str = lval_str(unescaped);
+/* Call fn on each value v holds a reference to. Cells, environments and
+   compiled code shared between values are visited once for each pass. */
+void lval_each_child(lval *v, int pass, void (*fn)(lval *, void *),
+                     void *ctx) {
+    switch (v->type) {
+    case LVAL_FUN:
+        if (!v->builtin) {
+            /* The root environment is held from outside, so its bindings
+               are never garbage and are not counted as children */
+            for (lenv *env = v->lambda->env; env->up && env->pass != pass;
+                 env = env->up) {
+                env->pass = pass;
+                for (int i = 0; i < env->cap; i++) {
+                    if (env->syms[i]) {
+                        fn(env->vals[i], ctx);
+                    }
+                }
+            }
+            fn(v->lambda->formals, ctx);
+            fn(v->lambda->body, ctx);
+
+            lcode *c = v->lambda->code;
+            if (c && c->pass != pass) {
+                c->pass = pass;
+                for (int i = 0; i < c->nconsts; i++) {
+                    fn(c->consts[i], ctx);
+                }
+            }
+        }
+        break;
 
-    /* Free the string and return */
-    free(unescaped);
+    case LVAL_QEXPR:
+    case LVAL_SEXPR:
+    case LVAL_VEC: {
+        lcells *b = lval_cells(v);
+        if (b && b->pass != pass) {
+            b->pass = pass;
+            for (int i = b->first; i < b->used; i++) {
+                fn(b->items[i], ctx);
+            }
+        }
+        break;
+    }
 
-    return str;
+    case LVAL_MAP:
+        for (int i = 0; i < v->map->cap; i++) {
+            if (v->map->slots[i].key) {
+                fn(v->map->slots[i].key, ctx);
+                fn(v->map->slots[i].val, ctx);
+            }
+        }
+        break;
+    }
 }
 
-lval *lval_add(lval *v, lval *x) {
-    v->count++;
-    v->cell = realloc(v->cell, sizeof(lval *) * v->count);
-    v->cell[v->count - 1] = x;
+/* Give v a block of its own holding just its cells, with room for cap */
+static void lval_cells_own(lval *v, int cap) {
+    lcells *old = lval_cells(v);
 
-    return v;
+    lcells *b = malloc(sizeof(lcells) + sizeof(lval *) * cap);
+    b->refs = 1;
+    b->pass = 0;
+    b->cap = cap;
+    b->first = 0;
+    b->used = v->count;
+    for (int i = 0; i < v->count; i++) {
+        b->items[i] = lval_ref(v->cell[i]);
+    }
+
+    lcells_del(old);
+    v->off = 0;
+    v->cell = b->items;
 }
 
-lval *lval_read(mpc_ast_t *t) {
-    /* If Symbol or Number, return conversion to that type */
-    if (strstr(t->tag, "number")) {
-        return lval_read_num(t);
-    }
-    if (strstr(t->tag, "symbol")) {
-        return lval_sym(t->contents);
-    }
-    if (strstr(t->tag, "string")) {
-        return lval_read_str(t);
-    }
+void lval_reserve(lval *v, int n) {
+    lcells *b = lval_cells(v);
+    int need = v->count + n;
 
-    /* If root (>) or sexpr then create empty list */
-    lval *x = NULL;
-    if (strcmp(t->tag, ">") == 0) {
-        x = lval_sexpr();
-    }
-    if (strstr(t->tag, "sexpr")) {
-        x = lval_sexpr();
-    }
-    if (strstr(t->tag, "qexpr")) {
-        x = lval_qexpr();
+    /* A shared block, or cells after the view, cannot be appended to */
+    if (!b || b->refs > 1 || v->off + v->count != b->used) {
+        lval_cells_own(v, need > 4 ? need : 4);
+        return;
     }
 
-    /* Fill this list with any valid expressions contained within */
-    for (int i = 0; i < t->children_num; i++) {
-        if (strcmp(t->children[i]->contents, "(") == 0) {
-            continue;
+    /* Otherwise grow the block geometrically */
+    if (v->off + need > b->cap) {
+        int cap = b->cap * 2;
+        if (cap < v->off + need) {
+            cap = v->off + need;
         }
-        if (strcmp(t->children[i]->contents, ")") == 0) {
-            continue;
-        }
-        if (strcmp(t->children[i]->contents, "{") == 0) {
-            continue;
-        }
-        if (strcmp(t->children[i]->contents, "}") == 0) {
-            continue;
-        }
-        if (strcmp(t->children[i]->tag, "regex") == 0) {
-            continue;
-        }
-        if (strstr(t->children[i]->tag, "comment")) {
-            continue;
-        }
-        x = lval_add(x, lval_read(t->children[i]));
+        b = realloc(b, sizeof(lcells) + sizeof(lval *) * cap);
+        b->cap = cap;
+        v->cell = b->items + v->off;
     }
-    return x;
 }
 
+lval *lval_add(lval *v, lval *x) {
+    lval_reserve(v, 1);
+    v->cell[v->count++] = x;
+    lval_cells(v)->used++;
+
+    return v;
+}
+
+lval *lval_ref(lval *v) {
+    v->refs++;
+    return v;
+}
+
+/* Shallow copy of v. Children are shared with the original. */
 lval *lval_copy(lval *v) {
-    lval *x = malloc(sizeof(lval));
+    lval *x = lval_alloc();
+    x->refs = 1;
     x->type = v->type;
 
     switch (v->type) {
@@ -303,11 +556,16 @@ lval *lval_copy(lval *v) {
     case LVAL_FUN:
         if (v->builtin) {
             x->builtin = v->builtin;
+            x->call = v->call;
         } else {
+            /* Calls bind into a new frame, so the environment, like the
+               formals, is never changed in place and can be shared */
             x->builtin = NULL;
-            x->env = lenv_copy(v->env);
-            x->formals = lval_copy(v->formals);
-            x->body = lval_copy(v->body);
+            x->lambda = llambda_alloc();
+            x->lambda->env = lenv_ref(v->lambda->env);
+            x->lambda->formals = lval_ref(v->lambda->formals);
+            x->lambda->body = lval_ref(v->lambda->body);
+            x->lambda->code = lcode_ref(v->lambda->code);
         }
         break;
     case LVAL_NUM:
@@ -317,6 +575,7 @@ lval *lval_copy(lval *v) {
     case LVAL_STR:
         x->str = malloc(strlen(v->str) + 1);
         strcpy(x->str, v->str);
+        break;
 
     /* Copy Strings using malloc and strcpy */
     case LVAL_ERR:
@@ -324,26 +583,80 @@ lval *lval_copy(lval *v) {
         strcpy(x->err, v->err);
         break;
 
+    /* Share the interned symbol name */
     case LVAL_SYM:
-        x->sym = malloc(strlen(v->sym) + 1);
-        strcpy(x->sym, v->sym);
+        x->sym = v->sym;
         break;
 
-    /* Copy lists by copying each sub-expression */
+    /* Copy lists as a view sharing the same cells */
     case LVAL_QEXPR:
     case LVAL_SEXPR:
+    case LVAL_VEC:
         x->count = v->count;
-        x->cell = malloc(sizeof(lval *) * v->count);
-
-        for (int i = 0; i < v->count; i++) {
-            x->cell[i] = lval_copy(v->cell[i]);
+        x->off = v->off;
+        x->cell = v->cell;
+        if (x->cell) {
+            lval_cells(x)->refs++;
         }
         break;
+
+    case LVAL_MAP:
+        x->map = lmap_copy(v->map);
+        break;
+    }
+
+    return x;
+}
+
+/* Return v, or a copy of it if it is shared. Only the node itself is
+   private, cells of a list may still be shared with other views. */
+static lval *lval_view(lval *v) {
+    if (v->refs == 1) {
+        return v;
     }
 
+    lval *x = lval_copy(v);
+    v->refs--;
+
     return x;
 }
 
+/* Narrow the view v to count of its cells from start, without copying.
+   Cells left out are released if no other view uses the block, and kept
+   by the block otherwise. */
+static void lval_narrow(lval *v, int start, int count) {
+    lcells *b = lval_cells(v);
+    if (b && b->refs == 1) {
+        for (int i = b->first; i < v->off + start; i++) {
+            lval_del(b->items[i]);
+        }
+        for (int i = v->off + start + count; i < b->used; i++) {
+            lval_del(b->items[i]);
+        }
+        b->first = v->off + start;
+        b->used = v->off + start + count;
+    }
+
+    v->cell += start;
+    v->off += start;
+    v->count = count;
+}
+
+/* Return v, or a copy of it if it is shared, ready to be changed in place */
+lval *lval_unshare(lval *v) {
+    v = lval_view(v);
+
+    /* Cells of a list are changed in place too */
+    if (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) {
+        lcells *b = lval_cells(v);
+        if (b && b->refs > 1) {
+            lval_cells_own(v, v->count);
+        }
+    }
+
+    return v;
+}
+
 void lval_print(lval *v) {
     switch (v->type) {
     case LVAL_NUM:
@@ -355,9 +668,9 @@ void lval_print(lval *v) {
             printf("<builtin>");
         } else {
             printf("(\\ )");
-            lval_print(v->formals);
+            lval_print(v->lambda->formals);
             putchar(' ');
-            lval_print(v->body);
+            lval_print(v->lambda->body);
             putchar(')');
         }
         break;
@@ -379,6 +692,12 @@ void lval_print(lval *v) {
     case LVAL_QEXPR:
         lval_expr_print(v, '{', '}');
         break;
+    case LVAL_VEC:
+        lval_expr_print(v, '[', ']');
+        break;
+    case LVAL_MAP:
+        lval_map_print(v);
+        break;
     }
 }
 
@@ -396,18 +715,33 @@ void lval_expr_print(lval *v, char open, char close) {
     putchar(close);
 }
 
+/* Print a map as #{key value ...}, in no particular order */
+void lval_map_print(lval *v) {
+    printf("#{");
+    int first = 1;
+    for (int i = 0; i < v->map->cap; i++) {
+        lmap_slot *s = &v->map->slots[i];
+        if (s->key) {
+            if (!first) {
+                putchar(' ');
+            }
+            lval_print(s->key);
+            putchar(' ');
+            lval_print(s->val);
+            first = 0;
+        }
+    }
+    putchar('}');
+}
+
 /* Print an lval followed by a newline */
 void lval_println(lval *v) {
     lval_print(v);
     putchar('\n');
 }
 
-lval *lval_eval_sexpr(lenv *e, lval *v) {
-    /* Evaluate children */
-    for (int i = 0; i < v->count; i++) {
-        v->cell[i] = lval_eval(e, v->cell[i]);
-    }
-
+/* Call an S-Expression whose children have already been evaluated */
+lval *lval_call_sexpr(lenv *e, lval *v) {
     /* Error checking */
     for (int i = 0; i < v->count; i++) {
         if (v->cell[i]->type == LVAL_ERR) {
@@ -425,6 +759,15 @@ lval *lval_eval_sexpr(lenv *e, lval *v) {
         return lval_take(v, 0);
     }
 
+    /* Builtins taking their arguments in place are called on the list as
+       it is, without shifting the function off */
+    lval *g = v->cell[0];
+    if (g->type == LVAL_FUN && g->builtin && g->call) {
+        lval *x = g->call(e, v->count - 1, v->cell + 1);
+        lval_del(v);
+        return x;
+    }
+
     /* Ensure first element is a function after evaluation */
     lval *f = lval_pop(v, 0);
     if (f->type != LVAL_FUN) {
@@ -442,32 +785,378 @@ lval *lval_eval_sexpr(lenv *e, lval *v) {
     return result;
 }
 
-lval *lval_eval(lenv *e, lval *v) {
-    /* Evaluate S-Expression */
-    if (v->type == LVAL_SYM) {
-        lval *x = lenv_get(e, v);
-        return x;
+/* Can an evaluated S-Expression be entered as a tail call. Evaluation
+   stops at the first error, so none of its children are errors. Builtins
+   called in place are left to lval_call_sexpr. */
+static int lval_is_tail_call(lval *v) {
+    lval *f = v->cell[0];
+    return v->count >= 2 && f->type == LVAL_FUN && !(f->builtin && f->call);
+}
+
+/* Evaluate the child c of some code, which is left as it is */
+static lval *lval_eval_child(lenv *e, lval *c) {
+    switch (c->type) {
+    case LVAL_SYM:
+        return lenv_get(e, c);
+    case LVAL_SEXPR:
+        return lval_eval_frame(e, NULL, lval_ref(c), 0);
+    default:
+        return lval_ref(c);
+    }
+}
+
+/* Lambda closing over e, with its body compiled for the VM where possible */
+static lval *lval_closure(lenv *e, lval *formals, lval *body) {
+    lval *f = lval_lambda(e, formals, body);
+    f->lambda->code = lcode_compile(formals, body);
+
+    return f;
+}
+
+/* Bound function with nothing left to bind, whose frame on top of e holds
+   the bindings of a let. Values are evaluated in order in that frame, so
+   each sees the ones before it. */
+static lval *lval_let(lenv *e, lval *binds, lval *body) {
+    if (binds->count % 2) {
+        return lval_err("Function 'let' passed an unpaired binding. "
+                        "Got %i items, expected an even number.",
+                        binds->count);
     }
-    if (v->type == LVAL_SEXPR) {
-        return lval_eval_sexpr(e, v);
+    for (int i = 0; i < binds->count; i += 2) {
+        if (binds->cell[i]->type != LVAL_SYM) {
+            return lval_err("Function 'let' cannot bind non-symbol. "
+                            "Got %s, Expected %s.",
+                            ltype_name(binds->cell[i]->type),
+                            ltype_name(LVAL_SYM));
+        }
+    }
+
+    /* The function holds the frame while the values are evaluated */
+    lenv *frame = lenv_frame(e);
+    lval *f = lval_lambda(frame, lval_qexpr(), lval_ref(body));
+    lenv_del(frame);
+
+    for (int i = 0; i < binds->count; i += 2) {
+        lval *x = lval_eval_child(frame, binds->cell[i + 1]);
+        if (x->type == LVAL_ERR) {
+            lval_del(f);
+            return x;
+        }
+        lenv_put(frame, binds->cell[i], x);
+        lval_del(x);
     }
 
-    /* All other lval types remain the same */
+    return f;
+}
+
+/* Make the let h the frame that evaluation continues in, replacing f.
+   Returns the body to evaluate. */
+static lval *lval_enter(lval **f, lval *h) {
+    if (*f) {
+        lval_del(*f);
+    }
+    *f = h;
+
+    return lval_ref(h->lambda->body);
+}
+
+/* Is every item of the Q-Expression v a symbol */
+static int lval_all_syms(lval *v) {
+    for (int i = 0; i < v->count; i++) {
+        if (v->cell[i]->type != LVAL_SYM) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* The builtin if, def, \ or let that v is a special form of, or NULL.
+   Special forms take their Q-Expression arguments straight from the code
+   instead of building an argument list, and if and let only evaluate what
+   they need. Anything unusual is left to the builtin to report. */
+static lbuiltin lval_form(lenv *e, lval *v) {
+    if (v->count < 2 || v->cell[0]->type != LVAL_SYM) {
+        return NULL;
+    }
+
+    char *s = v->cell[0]->sym;
+    lval **cells = v->cell;
+    lbuiltin form = NULL;
+    if (s == sym_if && v->count == 4 && cells[2]->type == LVAL_QEXPR &&
+        cells[3]->type == LVAL_QEXPR) {
+        form = builtin_if;
+    } else if (s == sym_let && v->count == 3 &&
+               cells[1]->type == LVAL_QEXPR && cells[2]->type == LVAL_QEXPR) {
+        form = builtin_let;
+    } else if (s == sym_lambda && v->count == 3 &&
+               cells[1]->type == LVAL_QEXPR && cells[2]->type == LVAL_QEXPR &&
+               lval_all_syms(cells[1])) {
+        form = builtin_lambda;
+    } else if (s == sym_def && cells[1]->type == LVAL_QEXPR &&
+               cells[1]->count == v->count - 2 && lval_all_syms(cells[1])) {
+        form = builtin_def;
+    } else {
+        return NULL;
+    }
+
+    /* Only while the name is still bound to the builtin */
+    lval *f = lenv_get(e, cells[0]);
+    if (f->type != LVAL_FUN || f->builtin != form) {
+        form = NULL;
+    }
+    lval_del(f);
+
+    return form;
+}
+
+/* Evaluate the values of the def v, then bind them */
+static lval *lval_def_form(lenv *e, lval *v) {
+    lval *syms = v->cell[1];
+    lval *x = lval_sexpr();
+    lval_reserve(x, syms->count);
+    for (int i = 0; i < syms->count; i++) {
+        lval *y = lval_eval_child(e, v->cell[i + 2]);
+        if (y->type == LVAL_ERR) {
+            lval_del(x);
+            return y;
+        }
+        lval_add(x, y);
+    }
+
+    for (int i = 0; i < syms->count; i++) {
+        lenv_def(e, syms->cell[i], x->cell[i]);
+    }
+
+    lval_del(x);
+    return lval_sexpr();
+}
+
+/* Evaluate v in the frame of the bound function f, or in e if f is NULL.
+   With code set a Q-Expression v is run as the S-Expression it quotes.
+   Calls in tail position replace the frame instead of growing the C stack,
+   so a function called from there no longer sees the replaced arguments.
+
+   Code is only read, never changed, so function bodies and the branches
+   of if are evaluated where they are instead of being copied first. */
+static lval *lval_eval_frame(lenv *e, lval *f, lval *v, int code) {
+    /* Function to apply to the arguments v in tail position, if any */
+    lval *g = NULL;
+
+    while (1) {
+        /* Everything held here is counted, so a collection is safe. Loops
+           run as tail calls never return to the top level to make one. */
+        lgc_poll();
+
+        lenv *env = f ? f->lambda->env : e;
+
+        if (!g) {
+            /* Evaluate Symbol */
+            if (v->type == LVAL_SYM) {
+                lval *x = lenv_get(env, v);
+                lval_del(v);
+                v = x;
+                break;
+            }
+
+            /* All other lval types remain the same */
+            if (v->type != LVAL_SEXPR && !(code && v->type == LVAL_QEXPR)) {
+                break;
+            }
+
+            lbuiltin form = lval_form(env, v);
+
+            /* Continue with the branch the condition selects */
+            if (form == builtin_if) {
+                lval *x = lval_eval_child(env, v->cell[1]);
+                if (x->type == LVAL_NUM) {
+                    lval *branch = lval_ref(v->cell[x->num ? 2 : 3]);
+                    lval_del(x);
+                    lval_del(v);
+                    v = branch;
+                    code = 1;
+                    continue;
+                }
+
+                /* Any other condition is the builtin's error to give */
+                if (x->type != LVAL_ERR) {
+                    lval *a = lval_add(lval_sexpr(), x);
+                    lval_add(a, lval_ref(v->cell[2]));
+                    x = builtin_if_expr(lval_add(a, lval_ref(v->cell[3])));
+                }
+                lval_del(v);
+                v = x;
+                break;
+            }
+
+            /* Continue with the body in a frame on top of this one */
+            if (form == builtin_let) {
+                lval *h = lval_let(env, v->cell[1], v->cell[2]);
+                lval_del(v);
+                if (h->type == LVAL_ERR) {
+                    v = h;
+                    break;
+                }
+                v = lval_enter(&f, h);
+                code = 1;
+                continue;
+            }
+
+            if (form) {
+                lval *x = form == builtin_def
+                              ? lval_def_form(env, v)
+                              : lval_closure(env, lval_ref(v->cell[1]),
+                                             lval_ref(v->cell[2]));
+                lval_del(v);
+                v = x;
+                break;
+            }
+
+            /* Evaluate children into a list of their values. An error is
+               the value of the whole expression, so the rest are skipped. */
+            lval *x = lval_sexpr();
+            lval_reserve(x, v->count);
+            lval *err = NULL;
+            for (int i = 0; i < v->count && !err; i++) {
+                lval *y = lval_eval_child(env, v->cell[i]);
+                if (y->type == LVAL_ERR) {
+                    err = y;
+                } else {
+                    lval_add(x, y);
+                }
+            }
+            lval_del(v);
+            if (err) {
+                lval_del(x);
+                v = err;
+                break;
+            }
+            v = x;
+            code = 0;
+
+            if (!lval_is_tail_call(v)) {
+                v = lval_call_sexpr(env, v);
+                break;
+            }
+
+            g = lval_pop(v, 0);
+        }
+
+        /* Continue with the expression selected by eval or if */
+        if (g->builtin == builtin_eval || g->builtin == builtin_if) {
+            lval *x = g->builtin == builtin_eval ? builtin_eval_expr(v)
+                                                 : builtin_if_expr(v);
+            lval_del(g);
+            g = NULL;
+            v = x;
+            code = 1;
+            continue;
+        }
+
+        if (g->builtin == builtin_let) {
+            lval *h = builtin_let_frame(env, v);
+            lval_del(g);
+            g = NULL;
+            if (h->type == LVAL_ERR) {
+                v = h;
+                break;
+            }
+            v = lval_enter(&f, h);
+            code = 1;
+            continue;
+        }
+
+        if (g->builtin) {
+            lval *x = g->builtin(env, v);
+            lval_del(g);
+            v = x;
+            break;
+        }
+
+        /* The callee no longer sees the arguments of this frame */
+        if (f) {
+            lval_del(f);
+            f = NULL;
+        }
+
+        if (vm_can_run(g, v)) {
+            ltail t;
+            lval *x = vm_run(e, g, v, &t);
+            lval_del(g);
+            if (x) {
+                v = x;
+                break;
+            }
+
+            /* Continue with the call the VM left in tail position */
+            f = t.frame;
+            g = t.f;
+            v = t.args;
+            continue;
+        }
+
+        /* Errors and partial applications are returned as they are */
+        lval *h = lval_bind(g, v);
+        lval_del(g);
+        g = NULL;
+        if (h->type == LVAL_ERR || h->lambda->formals->count) {
+            v = h;
+            break;
+        }
+
+        /* Otherwise continue with the body in place of the current frame */
+        f = h;
+        v = lval_ref(f->lambda->body);
+        code = 1;
+    }
+
+    if (f) {
+        lval_del(f);
+    }
     return v;
 }
 
+lval *lval_eval(lenv *e, lval *v) { return lval_eval_frame(e, NULL, v, 0); }
+
+lval *lval_eval_code(lenv *e, lval *v) {
+    return lval_eval_frame(e, NULL, v, 1);
+}
+
 lval *lval_pop(lval *v, int i) {
-    /* ifind the item at i */
+    lcells *b = lval_cells(v);
     lval *x = v->cell[i];
 
-    /* Shift memory after the item at i over the top */
-    memmove(&v->cell[i], &v->cell[i + 1], sizeof(lval *) * (v->count - i - 1));
+    /* Popping either end only narrows the view. A block used by this view
+       alone hands its reference over, otherwise the block keeps it. */
+    if (i == 0) {
+        if (b->refs == 1 && v->off == b->first) {
+            b->first++;
+        } else {
+            lval_ref(x);
+        }
+        v->cell++;
+        v->off++;
+        v->count--;
+        return x;
+    }
 
-    /* Decrease the count of items in the list */
-    v->count--;
+    if (i == v->count - 1) {
+        if (b->refs == 1 && v->off + v->count == b->used) {
+            b->used--;
+        } else {
+            lval_ref(x);
+        }
+        v->count--;
+        return x;
+    }
 
-    /* Reallocate the memory used */
-    v->cell = realloc(v->cell, sizeof(lval *) * v->count);
+    /* Otherwise shift the cells after i over the top in a private block */
+    if (b->refs > 1 || v->off + v->count != b->used) {
+        lval_cells_own(v, v->count);
+        b = lval_cells(v);
+    }
+    memmove(&v->cell[i], &v->cell[i + 1], sizeof(lval *) * (v->count - i - 1));
+    v->count--;
+    b->used--;
 
     return x;
 }
@@ -491,15 +1180,13 @@ lval *builtin_head(lenv *e, lval *a) {
             "Got %s, expected %s",
             ltype_name(a->cell[0]->type), ltype_name(LVAL_QEXPR));
 
-    LASSERT_EMPTY(a);
+    LASSERT_SHARED(a, a->cell[0]->count != 0, "Function 'head' passed {}!");
 
     /* Take first argument */
-    lval *v = lval_take(a, 0);
+    lval *v = lval_view(lval_take(a, 0));
 
-    /* Delete all elements that are not head and return */
-    while (v->count > 1) {
-        lval_del(lval_pop(v, 1));
-    }
+    /* Narrow the view to the first element and return */
+    lval_narrow(v, 0, 1);
 
     return v;
 }
@@ -515,10 +1202,10 @@ lval *builtin_tail(lenv *e, lval *a) {
             "Got %s, expected %s",
             ltype_name(a->cell[0]->type), ltype_name(LVAL_QEXPR));
 
-    LASSERT_EMPTY(a);
+    LASSERT_SHARED(a, a->cell[0]->count != 0, "Function 'tail' passed {}!");
 
     /* Otherwise take first argument */
-    lval *v = lval_take(a, 0);
+    lval *v = lval_view(lval_take(a, 0));
 
     /* Delete first element and return */
     lval_del(lval_pop(v, 0));
@@ -543,42 +1230,202 @@ lval *builtin_cons(lenv *e, lval *a) {
             "Got %s, expected %s",
             ltype_name(a->cell[1]->type), ltype_name(LVAL_QEXPR));
 
-    /* Take the first element from Qexpr */
+    /* Take the first element from Qexpr */
+
+    lval *x = lval_qexpr();
+    lval_add(x, lval_pop(a, 0));
+    lval *y = lval_pop(a, 0);
+    lval_del(a);
+
+    return lval_join(x, y);
+}
+
+lval *builtin_list(lenv *e, lval *a) {
+    a->type = LVAL_QEXPR;
+    return a;
+}
+
+/* Check the arguments of eval and return the expression it evaluates */
+lval *builtin_eval_expr(lval *a) {
+    LASSERT_SHARED(a, a->count == 1,
+                   "Function 'eval' passed too many arguments!");
+    LASSERT_SHARED(a, a->cell[0]->type == LVAL_QEXPR,
+                   "Function 'eval' passed incorrect type!");
+
+    return lval_take(a, 0);
+}
+
+lval *builtin_eval(lenv *e, lval *a) {
+    return lval_eval_code(e, builtin_eval_expr(a));
+}
+
+lval *builtin_join(lenv *e, lval *a) {
+    for (int i = 0; i < a->count; i++) {
+        LASSERT_SHARED(a, a->cell[i]->type == LVAL_QEXPR,
+                       "Function 'join' passed incorrect type!");
+    }
+
+    lval *x = lval_unshare(lval_pop(a, 0));
+
+    while (a->count) {
+        x = lval_join(x, lval_pop(a, 0));
+    }
+
+    lval_del(a);
+    return x;
+}
+
+lval *builtin_vec(lenv *e, lval *a) {
+    a->type = LVAL_VEC;
+    return a;
+}
+
+lval *builtin_nth(lenv *e, lval *a) {
+    LASSERT_NUM("nth", a, 2);
+    LASSERT_SEQ("nth", a, 0);
+    LASSERT_TYPE("nth", a, 1, LVAL_NUM);
+    LASSERT_INDEX("nth", a, a->cell[1]->num, a->cell[0]->count);
+
+    lval *x = lval_ref(a->cell[0]->cell[a->cell[1]->num]);
+    lval_del(a);
+    return x;
+}
+
+lval *builtin_len(lenv *e, lval *a) {
+    LASSERT_NUM("len", a, 1);
+    if (a->cell[0]->type != LVAL_MAP) {
+        LASSERT_SEQ("len", a, 0);
+    }
+
+    lval *x = lval_num(a->cell[0]->type == LVAL_MAP ? a->cell[0]->map->count
+                                                    : a->cell[0]->count);
+    lval_del(a);
+    return x;
+}
+
+lval *builtin_set(lenv *e, lval *a) {
+    LASSERT_NUM("set!", a, 3);
+    LASSERT_TYPE("set!", a, 0, LVAL_VEC);
+    LASSERT_TYPE("set!", a, 1, LVAL_NUM);
+    LASSERT_INDEX("set!", a, a->cell[1]->num, a->cell[0]->count);
+
+    /* The vector is changed in place, but cells shared with a slice of it
+       are copied first */
+    lval *v = lval_ref(a->cell[0]);
+    lcells *b = lval_cells(v);
+    if (b->refs > 1) {
+        lval_cells_own(v, v->count);
+    }
+
+    long i = a->cell[1]->num;
+    lval_del(v->cell[i]);
+    v->cell[i] = lval_ref(a->cell[2]);
+
+    lval_del(a);
+    return v;
+}
+
+lval *builtin_slice(lenv *e, lval *a) {
+    LASSERT_NUM("slice", a, 3);
+    LASSERT_SEQ("slice", a, 0);
+    LASSERT_TYPE("slice", a, 1, LVAL_NUM);
+    LASSERT_TYPE("slice", a, 2, LVAL_NUM);
+
+    long start = a->cell[1]->num;
+    long end = a->cell[2]->num;
+    LASSERT(a, start >= 0 && start <= end && end <= a->cell[0]->count,
+            "Function 'slice' passed range %li to %li out of range for "
+            "length %i",
+            start, end, a->cell[0]->count);
+
+    /* A view of the same cells, copied only if either is changed */
+    lval *v = lval_view(lval_take(a, 0));
+    lval_narrow(v, start, end - start);
+
+    return v;
+}
+
+lval *builtin_push(lenv *e, lval *a) {
+    LASSERT_NUM("push", a, 2);
+    LASSERT_TYPE("push", a, 0, LVAL_VEC);
+
+    lval *v = lval_ref(a->cell[0]);
+    lval_add(v, lval_ref(a->cell[1]));
 
-    lval *x = lval_qexpr();
-    lval_add(x, lval_pop(a, 0));
-    lval *y = lval_pop(a, 0);
     lval_del(a);
+    return v;
+}
 
-    return lval_join(x, y);
+lval *builtin_hash_map(lenv *e, lval *a) {
+    LASSERT_SHARED(a, a->count % 2 == 0,
+                   "Function 'hash-map' passed a key without a value");
+    for (int i = 0; i < a->count; i += 2) {
+        LASSERT_KEY("hash-map", a, i);
+    }
+
+    lval *m = lval_map();
+    for (int i = 0; i < a->count; i += 2) {
+        lmap_put(m->map, lval_ref(a->cell[i]), lval_ref(a->cell[i + 1]));
+    }
+
+    lval_del(a);
+    return m;
 }
 
-lval *builtin_list(lenv *e, lval *a) {
-    a->type = LVAL_QEXPR;
-    return a;
+lval *builtin_get(lenv *e, lval *a) {
+    LASSERT_SHARED(a, a->count == 2 || a->count == 3,
+                   "Function 'get' must be called with 2 or 3 arguments");
+    LASSERT_TYPE("get", a, 0, LVAL_MAP);
+    LASSERT_KEY("get", a, 1);
+
+    /* A missing key gives the default if there is one */
+    lval *x = lmap_get(a->cell[0]->map, a->cell[1]);
+    if (!x && a->count == 2) {
+        lval *err = lval_err("Key not found");
+        lval_del(a);
+        return err;
+    }
+
+    x = lval_ref(x ? x : a->cell[2]);
+    lval_del(a);
+    return x;
 }
 
-lval *builtin_eval(lenv *e, lval *a) {
-    LASSERT(a, a->count == 1, "Function 'eval' passed too many arguments!");
-    LASSERT(a, a->cell[0]->type == LVAL_QEXPR,
-            "Function 'eval' passed incorrect type!");
+lval *builtin_map_put(lenv *e, lval *a) {
+    LASSERT_NUM("put", a, 3);
+    LASSERT_TYPE("put", a, 0, LVAL_MAP);
+    LASSERT_KEY("put", a, 1);
 
-    lval *x = lval_take(a, 0);
-    x->type = LVAL_SEXPR;
+    lval *m = lval_ref(a->cell[0]);
+    lmap_put(m->map, lval_ref(a->cell[1]), lval_ref(a->cell[2]));
 
-    return lval_eval(e, x);
+    lval_del(a);
+    return m;
 }
 
-lval *builtin_join(lenv *e, lval *a) {
-    for (int i = 0; i < a->count; i++) {
-        LASSERT(a, a->cell[i]->type == LVAL_QEXPR,
-                "Function 'join' passed incorrect type!");
-    }
+lval *builtin_remove(lenv *e, lval *a) {
+    LASSERT_NUM("remove", a, 2);
+    LASSERT_TYPE("remove", a, 0, LVAL_MAP);
+    LASSERT_KEY("remove", a, 1);
 
-    lval *x = lval_pop(a, 0);
+    lval *m = lval_ref(a->cell[0]);
+    lmap_remove(m->map, a->cell[1]);
 
-    while (a->count) {
-        x = lval_join(x, lval_pop(a, 0));
+    lval_del(a);
+    return m;
+}
+
+lval *builtin_keys(lenv *e, lval *a) {
+    LASSERT_NUM("keys", a, 1);
+    LASSERT_TYPE("keys", a, 0, LVAL_MAP);
+
+    lmap *m = a->cell[0]->map;
+    lval *x = lval_qexpr();
+    lval_reserve(x, m->count);
+    for (int i = 0; i < m->cap; i++) {
+        if (m->slots[i].key) {
+            lval_add(x, lval_ref(m->slots[i].key));
+        }
     }
 
     lval_del(a);
@@ -587,73 +1434,258 @@ lval *builtin_join(lenv *e, lval *a) {
 
 lval *lval_join(lval *x, lval *y) {
     /* For each cell in 'y' add it to 'x' */
-    while (y->count) {
-        x = lval_add(x, lval_pop(y, 0));
+    lval_reserve(x, y->count);
+    for (int i = 0; i < y->count; i++) {
+        x = lval_add(x, lval_ref(y->cell[i]));
     }
 
-    /* Delete empty 'y' and return 'x' */
+    /* Delete 'y' and return 'x' */
     lval_del(y);
     return x;
 }
 
-lval *builtin_add(lenv *e, lval *a) { return builtin_op(e, a, "+"); }
+lval *builtin_add(lenv *e, lval *a) { return builtin_op(e, a, LOP_ADD); }
+
+lval *builtin_sub(lenv *e, lval *a) { return builtin_op(e, a, LOP_SUB); }
+
+lval *builtin_mul(lenv *e, lval *a) { return builtin_op(e, a, LOP_MUL); }
+
+lval *builtin_div(lenv *e, lval *a) { return builtin_op(e, a, LOP_DIV); }
+
+lval *builtin_add_argv(lenv *e, int argc, lval **argv) {
+    return builtin_op_argv(e, argc, argv, LOP_ADD);
+}
+
+lval *builtin_sub_argv(lenv *e, int argc, lval **argv) {
+    return builtin_op_argv(e, argc, argv, LOP_SUB);
+}
+
+lval *builtin_mul_argv(lenv *e, int argc, lval **argv) {
+    return builtin_op_argv(e, argc, argv, LOP_MUL);
+}
+
+lval *builtin_div_argv(lenv *e, int argc, lval **argv) {
+    return builtin_op_argv(e, argc, argv, LOP_DIV);
+}
 
-lval *builtin_sub(lenv *e, lval *a) { return builtin_op(e, a, "-"); }
+/* Names of the operators, for error messages */
+static char *lop_name[] = {"+", "-", "*",  "/",  ">",
+                           "<", ">=", "<=", "==", "!="};
 
-lval *builtin_mul(lenv *e, lval *a) { return builtin_op(e, a, "*"); }
+/* Names of the element-wise vector builtins, by operator */
+static char *lop_vname[] = {"vadd", "vsub", "vmul", "vdiv", "vgt",
+                            "vlt",  "vge",  "vle",  "veq",  "vne"};
 
-lval *builtin_div(lenv *e, lval *a) { return builtin_op(e, a, "/"); }
+/* Builtins called with an argument list hand its cells to the in place
+   form and release the list after */
+lval *builtin_op(lenv *e, lval *a, int op) {
+    lval *x = builtin_op_argv(e, a->count, a->cell, op);
+    lval_del(a);
+    return x;
+}
 
-lval *builtin_op(lenv *e, lval *a, char *op) {
+lval *builtin_op_argv(lenv *e, int argc, lval **argv, int op) {
     /* Ensure all arguments are numbers */
-    for (int i = 0; i < a->count; i++) {
-        if (a->cell[i]->type != LVAL_NUM) {
-            lval_del(a);
-            return lval_err("Operands must be numbers");
+    for (int i = 0; i < argc; i++) {
+        if (argv[i]->type != LVAL_NUM) {
+            return lval_err_shared("Operands must be numbers");
         }
     }
 
-    /* Pop the first element */
-    lval *x = lval_pop(a, 0);
+    long x = argv[0]->num;
 
     /* If no arguments and sub then perform unary negation */
-    if ((strcmp(op, "-") == 0) && a->count == 0) {
-        x->num = -x->num;
+    if (op == LOP_SUB && argc == 1) {
+        x = -x;
     }
 
-    /* While there are still elemets remaining */
-    while (a->count > 0) {
-        /* Pop the next element */
-        lval *y = lval_pop(a, 0);
-        if (strcmp(op, "+") == 0) {
-            x->num += y->num;
+    /* Fold the remaining operands in with the operator chosen once */
+    switch (op) {
+    case LOP_ADD:
+        for (int i = 1; i < argc; i++) {
+            x += argv[i]->num;
         }
-        if (strcmp(op, "-") == 0) {
-            x->num -= y->num;
+        break;
+    case LOP_SUB:
+        for (int i = 1; i < argc; i++) {
+            x -= argv[i]->num;
         }
-        if (strcmp(op, "*") == 0) {
-            x->num *= y->num;
+        break;
+    case LOP_MUL:
+        for (int i = 1; i < argc; i++) {
+            x *= argv[i]->num;
         }
-        if (strcmp(op, "/") == 0) {
-            if (y->num == 0) {
-                lval_del(x);
-                lval_del(y);
-                x = lval_err("Division by zero");
-                break;
+        break;
+    case LOP_DIV:
+        for (int i = 1; i < argc; i++) {
+            if (argv[i]->num == 0) {
+                return lval_err_shared("Division by zero");
             }
-            x->num /= y->num;
+            x /= argv[i]->num;
         }
-        lval_del(y);
+        break;
     }
-    lval_del(a);
 
+    return lval_num(x);
+}
+
+/* Numbers of a vector or Q-Expression copied into a new array, or NULL if
+   any element is not a number */
+static long *lval_unbox(lval *v) {
+    long *x = malloc(sizeof(long) * (v->count ? v->count : 1));
+    for (int i = 0; i < v->count; i++) {
+        if (v->cell[i]->type != LVAL_NUM) {
+            free(x);
+            return NULL;
+        }
+        x[i] = v->cell[i]->num;
+    }
     return x;
 }
 
+/* Vector of the n numbers in x */
+static lval *lval_box(long *x, int n) {
+    lval *v = lval_vec();
+    lval_reserve(v, n);
+    for (int i = 0; i < n; i++) {
+        lval_add(v, lval_num(x[i]));
+    }
+    return v;
+}
+
+lval *builtin_vadd(lenv *e, lval *a) { return builtin_vop(e, a, LOP_ADD); }
+
+lval *builtin_vsub(lenv *e, lval *a) { return builtin_vop(e, a, LOP_SUB); }
+
+lval *builtin_vmul(lenv *e, lval *a) { return builtin_vop(e, a, LOP_MUL); }
+
+lval *builtin_vgt(lenv *e, lval *a) { return builtin_vop(e, a, LOP_GT); }
+
+lval *builtin_vlt(lenv *e, lval *a) { return builtin_vop(e, a, LOP_LT); }
+
+lval *builtin_vge(lenv *e, lval *a) { return builtin_vop(e, a, LOP_GE); }
+
+lval *builtin_vle(lenv *e, lval *a) { return builtin_vop(e, a, LOP_LE); }
+
+lval *builtin_veq(lenv *e, lval *a) { return builtin_vop(e, a, LOP_EQ); }
+
+lval *builtin_vne(lenv *e, lval *a) { return builtin_vop(e, a, LOP_NE); }
+
+/* Apply op to each pair of elements of two vectors of numbers, unboxed so
+   the kernel runs over plain arrays */
+lval *builtin_vop(lenv *e, lval *a, int op) {
+    char *name = lop_vname[op];
+    LASSERT_NUM(name, a, 2);
+    LASSERT_SEQ(name, a, 0);
+    LASSERT_SEQ(name, a, 1);
+    LASSERT(a, a->cell[0]->count == a->cell[1]->count,
+            "Function '%s' passed vectors of length %i and %i", name,
+            a->cell[0]->count, a->cell[1]->count);
+
+    int n = a->cell[0]->count;
+    long *x = lval_unbox(a->cell[0]);
+    long *y = lval_unbox(a->cell[1]);
+    if (!x || !y) {
+        free(x);
+        free(y);
+        lval_del(a);
+        return lval_err("Function '%s' passed an element which is not a "
+                        "number",
+                        name);
+    }
+    lval_del(a);
+
+    lnum_elem(x, x, y, n, op);
+    lval *v = lval_box(x, n);
+    free(x);
+    free(y);
+
+    return v;
+}
+
+lval *builtin_vsum(lenv *e, lval *a) {
+    LASSERT_NUM("vsum", a, 1);
+    LASSERT_SEQ("vsum", a, 0);
+
+    int n = a->cell[0]->count;
+    long *x = lval_unbox(a->cell[0]);
+    LASSERT_SHARED(a, x,
+                   "Function 'vsum' passed an element which is not a number");
+    lval_del(a);
+
+    long sum = lnum_sum(x, n);
+    free(x);
+    return lval_num(sum);
+}
+
+lval *builtin_vmin(lenv *e, lval *a) {
+    LASSERT_NUM("vmin", a, 1);
+    LASSERT_SEQ("vmin", a, 0);
+    LASSERT_SHARED(a, a->cell[0]->count != 0,
+                   "Function 'vmin' passed an empty vector");
+
+    int n = a->cell[0]->count;
+    long *x = lval_unbox(a->cell[0]);
+    LASSERT_SHARED(a, x,
+                   "Function 'vmin' passed an element which is not a number");
+    lval_del(a);
+
+    long min = lnum_min(x, n);
+    free(x);
+    return lval_num(min);
+}
+
+lval *builtin_vmax(lenv *e, lval *a) {
+    LASSERT_NUM("vmax", a, 1);
+    LASSERT_SEQ("vmax", a, 0);
+    LASSERT_SHARED(a, a->cell[0]->count != 0,
+                   "Function 'vmax' passed an empty vector");
+
+    int n = a->cell[0]->count;
+    long *x = lval_unbox(a->cell[0]);
+    LASSERT_SHARED(a, x,
+                   "Function 'vmax' passed an element which is not a number");
+    lval_del(a);
+
+    long max = lnum_max(x, n);
+    free(x);
+    return lval_num(max);
+}
+
+lval *builtin_vdot(lenv *e, lval *a) {
+    LASSERT_NUM("vdot", a, 2);
+    LASSERT_SEQ("vdot", a, 0);
+    LASSERT_SEQ("vdot", a, 1);
+    LASSERT(a, a->cell[0]->count == a->cell[1]->count,
+            "Function 'vdot' passed vectors of length %i and %i",
+            a->cell[0]->count, a->cell[1]->count);
+
+    int n = a->cell[0]->count;
+    long *x = lval_unbox(a->cell[0]);
+    long *y = lval_unbox(a->cell[1]);
+    if (!x || !y) {
+        free(x);
+        free(y);
+        lval_del(a);
+        return lval_err("Function '%s' passed an element which is not a "
+                        "number",
+                        "vdot");
+    }
+    lval_del(a);
+
+    long dot = lnum_dot(x, y, n);
+    free(x);
+    free(y);
+    return lval_num(dot);
+}
+
 lenv *lenv_new(void) {
-    lenv *e = malloc(sizeof(lenv));
-    e->par = NULL;
+    lenv *e = lenv_alloc();
+    e->up = NULL;
+    e->refs = 1;
+    e->pass = 0;
     e->count = 0;
+    e->cap = 0;
     e->syms = NULL;
     e->vals = NULL;
 
@@ -661,54 +1693,103 @@ lenv *lenv_new(void) {
 }
 
 void lenv_del(lenv *e) {
-    for (int i = 0; i < e->count; i++) {
-        free(e->syms[i]);
-        lval_del(e->vals[i]);
+    /* Only free once the last closure sharing e lets go */
+    if (--e->refs > 0) {
+        return;
+    }
+
+    if (e->up) {
+        lenv_del(e->up);
+    }
+    for (int i = 0; i < e->cap; i++) {
+        if (e->syms[i]) {
+            lval_del(e->vals[i]);
+        }
     }
 
     free(e->syms);
     free(e->vals);
-    free(e);
+    lenv_free(e);
 }
 
-lval *lenv_get(lenv *e, lval *k) {
-    for (int i = 0; i < e->count; i++) {
-        if (strcmp(e->syms[i], k->sym) == 0) {
-            return lval_copy(e->vals[i]);
+/* Drop every binding in e. Closures bound in the root environment refer
+   back to it, so this lets them go before the root itself is deleted. */
+void lenv_clear(lenv *e) {
+    for (int i = 0; i < e->cap; i++) {
+        if (e->syms[i]) {
+            lval *v = e->vals[i];
+            e->syms[i] = NULL;
+            e->vals[i] = NULL;
+            e->count--;
+            lval_del(v);
         }
     }
+}
 
-    /* If no symbol, check in parent, otherwise error */
-    if (e->par) {
-        return lenv_get(e->par, k);
-    } else {
-        return lval_err("Unbound Symbol '%s'", k->sym);
+/* Find the slot holding interned symbol s, or the empty slot it belongs in */
+static int lenv_slot(lenv *e, char *s) {
+    int i = sym_hash(s) & (e->cap - 1);
+    while (e->syms[i] && e->syms[i] != s) {
+        i = (i + 1) & (e->cap - 1);
     }
+    return i;
 }
 
-void lenv_put(lenv *e, lval *k, lval *v) {
-    /* Iterate over all items in environment */
-    /* This is to see if variable already exists */
-    for (int i = 0; i < e->count; i++) {
+static void lenv_grow(lenv *e) {
+    int old_cap = e->cap;
+    char **old_syms = e->syms;
+    lval **old_vals = e->vals;
+
+    e->cap = old_cap ? old_cap * 2 : 8;
+    e->syms = calloc(e->cap, sizeof(char *));
+    e->vals = malloc(sizeof(lval *) * e->cap);
+
+    /* Rehash existing entries into the larger table */
+    for (int i = 0; i < old_cap; i++) {
+        if (old_syms[i]) {
+            int j = lenv_slot(e, old_syms[i]);
+            e->syms[j] = old_syms[i];
+            e->vals[j] = old_vals[i];
+        }
+    }
 
-        /* If variable is found, delete item at that position*/
-        /* Replace with variable supplied by user */
-        if (strcmp(e->syms[i], k->sym) == 0) {
-            lval_del(e->vals[i]);
-            e->vals[i] = lval_copy(v);
-            return;
+    free(old_syms);
+    free(old_vals);
+}
+
+lval *lenv_get(lenv *e, lval *k) {
+    /* Check the frame and those it extends, out to the root */
+    for (; e; e = e->up) {
+        if (e->count) {
+            int i = lenv_slot(e, k->sym);
+            if (e->syms[i]) {
+                return lval_ref(e->vals[i]);
+            }
         }
     }
 
-    /* If no existing entry found, allocate space for new entry */
-    e->count++;
-    e->vals = realloc(e->vals, sizeof(lval *) * e->count);
-    e->syms = realloc(e->syms, sizeof(char *) * e->count);
+    return lval_err("Unbound Symbol '%s'", k->sym);
+}
+
+void lenv_put(lenv *e, lval *k, lval *v) {
+    /* Keep the load factor under three quarters */
+    if ((e->count + 1) * 4 > e->cap * 3) {
+        lenv_grow(e);
+    }
+
+    int i = lenv_slot(e, k->sym);
+
+    /* If variable already exists replace it with the value supplied */
+    if (e->syms[i]) {
+        lval_del(e->vals[i]);
+        e->vals[i] = lval_ref(v);
+        return;
+    }
 
-    /* Copy contents of lval and symbol string into new location */
-    e->vals[e->count - 1] = lval_copy(v);
-    e->syms[e->count - 1] = malloc(strlen(k->sym) + 1);
-    strcpy(e->syms[e->count - 1], k->sym);
+    /* Otherwise store a copy in the empty slot */
+    e->count++;
+    e->syms[i] = k->sym;
+    e->vals[i] = lval_ref(v);
 }
 
 void lenv_add_builtin(lenv *e, char *name, lbuiltin func) {
@@ -719,37 +1800,111 @@ void lenv_add_builtin(lenv *e, char *name, lbuiltin func) {
     lval_del(v);
 }
 
-void lenv_add_builtins(lenv *e) {
+/* Every builtin and the name it is bound to, with the form taking its
+   arguments in place if it has one */
+static struct {
+    char *name;
+    lbuiltin func;
+    lbuiltin_argv call;
+} lval_builtins[] = {
     /* List Functions */
-    lenv_add_builtin(e, "list", builtin_list);
-    lenv_add_builtin(e, "head", builtin_head);
-    lenv_add_builtin(e, "tail", builtin_tail);
-    lenv_add_builtin(e, "cons", builtin_cons);
-    lenv_add_builtin(e, "eval", builtin_eval);
-    lenv_add_builtin(e, "join", builtin_join);
-    lenv_add_builtin(e, "def", builtin_def);
-    lenv_add_builtin(e, "=", builtin_put);
-    lenv_add_builtin(e, "\\", builtin_lambda);
-    lenv_add_builtin(e, ">", builtin_gt);
-    lenv_add_builtin(e, "<", builtin_lt);
-    lenv_add_builtin(e, ">=", builtin_ge);
-    lenv_add_builtin(e, "<=", builtin_le);
-    lenv_add_builtin(e, "==", builtin_eq);
-    lenv_add_builtin(e, "!=", builtin_ne);
-    lenv_add_builtin(e, "if", builtin_if);
-    lenv_add_builtin(e, "load", builtin_load);
-    lenv_add_builtin(e, "error", builtin_error);
-    lenv_add_builtin(e, "print", builtin_print);
+    {"list", builtin_list},
+    {"head", builtin_head},
+    {"tail", builtin_tail},
+    {"cons", builtin_cons},
+    {"eval", builtin_eval},
+    {"join", builtin_join},
+    {"def", builtin_def},
+    {"=", builtin_put},
+    {"\\", builtin_lambda},
+    {">", builtin_gt, builtin_gt_argv},
+    {"<", builtin_lt, builtin_lt_argv},
+    {">=", builtin_ge, builtin_ge_argv},
+    {"<=", builtin_le, builtin_le_argv},
+    {"==", builtin_eq, builtin_eq_argv},
+    {"!=", builtin_ne, builtin_ne_argv},
+    {"if", builtin_if},
+    {"let", builtin_let},
+    {"load", builtin_load},
+    {"error", builtin_error},
+    {"print", builtin_print},
+
+    /* Vector Functions */
+    {"vec", builtin_vec},
+    {"nth", builtin_nth},
+    {"len", builtin_len},
+    {"set!", builtin_set},
+    {"slice", builtin_slice},
+    {"push", builtin_push},
+
+    /* Map Functions */
+    {"hash-map", builtin_hash_map},
+    {"get", builtin_get},
+    {"put", builtin_map_put},
+    {"remove", builtin_remove},
+    {"keys", builtin_keys},
+
+    /* Bulk Numeric Functions */
+    {"vadd", builtin_vadd},
+    {"vsub", builtin_vsub},
+    {"vmul", builtin_vmul},
+    {"vgt", builtin_vgt},
+    {"vlt", builtin_vlt},
+    {"vge", builtin_vge},
+    {"vle", builtin_vle},
+    {"veq", builtin_veq},
+    {"vne", builtin_vne},
+    {"vsum", builtin_vsum},
+    {"vmin", builtin_vmin},
+    {"vmax", builtin_vmax},
+    {"vdot", builtin_vdot},
 
     /* Math Functions */
-    lenv_add_builtin(e, "+", builtin_add);
-    lenv_add_builtin(e, "-", builtin_sub);
-    lenv_add_builtin(e, "*", builtin_mul);
-    lenv_add_builtin(e, "/", builtin_div);
+    {"+", builtin_add, builtin_add_argv},
+    {"-", builtin_sub, builtin_sub_argv},
+    {"*", builtin_mul, builtin_mul_argv},
+    {"/", builtin_div, builtin_div_argv},
+
+    {NULL, NULL}};
+
+void lenv_add_builtins(lenv *e) {
+    for (int i = 0; lval_builtins[i].name; i++) {
+        lenv_add_builtin(e, lval_builtins[i].name, lval_builtins[i].func);
+    }
+}
+
+/* Name a builtin is bound to, or NULL if f is not one */
+char *lbuiltin_name(lbuiltin f) {
+    for (int i = 0; lval_builtins[i].name; i++) {
+        if (lval_builtins[i].func == f) {
+            return lval_builtins[i].name;
+        }
+    }
+    return NULL;
+}
+
+/* Form of the builtin f taking its arguments in place, or NULL */
+lbuiltin_argv lbuiltin_call(lbuiltin f) {
+    for (int i = 0; lval_builtins[i].name; i++) {
+        if (lval_builtins[i].func == f) {
+            return lval_builtins[i].call;
+        }
+    }
+    return NULL;
+}
+
+/* Builtin bound to the name, or NULL if there is none */
+lbuiltin lbuiltin_find(char *name) {
+    for (int i = 0; lval_builtins[i].name; i++) {
+        if (strcmp(lval_builtins[i].name, name) == 0) {
+            return lval_builtins[i].func;
+        }
+    }
+    return NULL;
 }
 
-lval *builtin_def(lenv *e, lval *a) { return builtin_var(e, a, "def"); }
-lval *builtin_put(lenv *e, lval *a) { return builtin_var(e, a, "="); }
+lval *builtin_def(lenv *e, lval *a) { return builtin_var(e, a, sym_def); }
+lval *builtin_put(lenv *e, lval *a) { return builtin_var(e, a, sym_put); }
 
 lval *builtin_lambda(lenv *e, lval *a) {
     /* Check two arguments, each of which ar Q-Expressions */
@@ -764,12 +1919,34 @@ lval *builtin_lambda(lenv *e, lval *a) {
                 ltype_name(a->cell[0]->cell[i]->type), ltype_name(LVAL_SYM));
     }
 
-    /* Pop first two arguments and pass them to lval_lambda */
+    /* Pop first two arguments and pass them to lval_closure */
     lval *formals = lval_pop(a, 0);
     lval *body = lval_pop(a, 0);
     lval_del(a);
 
-    return lval_lambda(formals, body);
+    return lval_closure(e, formals, body);
+}
+
+/* Check the arguments of let and return the function holding its frame */
+lval *builtin_let_frame(lenv *e, lval *a) {
+    LASSERT_NUM("let", a, 2);
+    LASSERT_TYPE("let", a, 0, LVAL_QEXPR);
+    LASSERT_TYPE("let", a, 1, LVAL_QEXPR);
+
+    lval *f = lval_let(e, a->cell[0], a->cell[1]);
+    lval_del(a);
+
+    return f;
+}
+
+lval *builtin_let(lenv *e, lval *a) {
+    lval *f = builtin_let_frame(e, a);
+    if (f->type == LVAL_ERR) {
+        return f;
+    }
+
+    /* Evaluate the body in the frame of the bindings */
+    return lval_eval_frame(e, f, lval_ref(f->lambda->body), 1);
 }
 
 lval *builtin_var(lenv *e, lval *a, char *func) {
@@ -789,10 +1966,10 @@ lval *builtin_var(lenv *e, lval *a, char *func) {
             func, syms->count, a->count - 1);
 
     for (int i = 0; i < syms->count; i++) {
-        if (strcmp(func, "def") == 0) {
+        if (func == sym_def) {
             lenv_def(e, syms->cell[i], a->cell[i + 1]);
         }
-        if (strcmp(func, "=") == 0) {
+        if (func == sym_put) {
             lenv_put(e, syms->cell[i], a->cell[i + 1]);
         }
     }
@@ -817,31 +1994,33 @@ char *ltype_name(int t) {
         return "Qexpr";
     case LVAL_SEXPR:
         return "Sexpr";
+    case LVAL_VEC:
+        return "Vector";
+    case LVAL_MAP:
+        return "Map";
     default:
         return "Unknown";
     }
 }
 
-lenv *lenv_copy(lenv *e) {
-    lenv *n = malloc(sizeof(lenv));
-    n->par = e->par;
-    n->count = e->count;
-    n->syms = malloc(sizeof(char *) * n->count);
-    n->vals = malloc(sizeof(lval *) * n->count);
+lenv *lenv_ref(lenv *e) {
+    e->refs++;
+    return e;
+}
 
-    for (int i = 0; i < e->count; i++) {
-        n->syms[i] = malloc(strlen(e->syms[i]) + 1);
-        strcpy(n->syms[i], e->syms[i]);
-        n->vals[i] = lval_copy(e->vals[i]);
-    }
+/* New frame for bindings made on top of those in up, which is shared */
+lenv *lenv_frame(lenv *up) {
+    /* Even an empty frame is kept, as '=' may bind into it later */
+    lenv *n = lenv_new();
+    n->up = lenv_ref(up);
 
     return n;
 }
 
 void lenv_def(lenv *e, lval *k, lval *v) {
-    /* Iterate till e has no parent */
-    while (e->par) {
-        e = e->par;
+    /* Iterate till e is the root */
+    while (e->up) {
+        e = e->up;
     }
     /* Put value in e */
     lenv_put(e, k, v);
@@ -849,124 +2028,178 @@ void lenv_def(lenv *e, lval *k, lval *v) {
 
 lval *lval_call(lenv *e, lval *f, lval *a) {
     /* If builtin, then simply call that */
+    if (f->builtin && f->call) {
+        lval *x = f->call(e, a->count, a->cell);
+        lval_del(a);
+        return x;
+    }
     if (f->builtin) {
         return f->builtin(e, a);
     }
 
+    /* Run compiled functions applied to all their arguments on the VM */
+    if (vm_can_run(f, a)) {
+        return vm_run(e, f, a, NULL);
+    }
+
+    /* Errors and partial applications are returned as they are */
+    f = lval_bind(f, a);
+    if (f->type == LVAL_ERR || f->lambda->formals->count) {
+        return f;
+    }
+
+    /* Evaluate the body in the bound environment */
+    return lval_eval_frame(e, f, lval_ref(f->lambda->body), 1);
+}
+
+/* Bind the arguments a into a private copy of the lambda f. Returns the
+   copy, partially applied if arguments are missing, or an error. */
+lval *lval_bind(lval *f, lval *a) {
+    lval *formals = f->lambda->formals;
+
     /* Record argument counts */
     int given = a->count;
-    int total = f->formals->count;
+    int total = formals->count;
 
+    /* f may be shared, so bind into a copy with a frame of its own on top
+       of the environment it captured */
+    f = lval_copy(f);
+    lenv *env = lenv_frame(f->lambda->env);
+    lenv_del(f->lambda->env);
+    f->lambda->env = env;
+
+    /* Formals are read in place, counting those bound so far */
+    int i = 0;
     while (a->count) {
         /* If we've run out of formal argument to bind */
-        if (f->formals->count == 0) {
+        if (i == total) {
             lval_del(a);
+            lval_del(f);
             return lval_err("Function passed too many arguments."
                             "Got %i, expected %i.",
                             given, total);
         }
 
-        /* Pop the first symbol from the formals */
-        lval *sym = lval_pop(f->formals, 0);
+        lval *sym = formals->cell[i++];
 
         /* Special case to deal with '&' */
-        if (strcmp(sym->sym, "&") == 0) {
+        if (sym->sym == sym_amp) {
             /* Ensure '&' is followed by another symbol */
-            if (f->formals->count != 1) {
+            if (total - i != 1) {
                 lval_del(a);
+                lval_del(f);
                 return lval_err("Function format invalid. "
                                 "Symbol '&' not followed by a single symbol.");
             }
 
             /* Next formal should be bound to remaining arguments */
-            lval *nsym = lval_pop(f->formals, 0);
-            lenv_put(f->env, nsym, builtin_list(e, a));
-            lval_del(sym);
-            lval_del(nsym);
+            lenv_put(env, formals->cell[i++], builtin_list(NULL, a));
             break;
         }
 
-        /* Pop the next argument from the list */
+        /* Pop the next argument from the list and bind it */
         lval *val = lval_pop(a, 0);
-
-        /* Bind  copy into the function's environment */
-        lenv_put(f->env, sym, val);
-
-        /* Delete symbol and value */
-        lval_del(sym);
+        lenv_put(env, sym, val);
         lval_del(val);
     }
 
     /* Argument list is now bound, so can be cleaned up */
     lval_del(a);
 
-    /* rif '&' remains in formal list, bind to empty list */
-    if (f->formals->count > 0 && strcmp(f->formals->cell[0]->sym, "&") == 0) {
+    /* If '&' remains in formal list, bind to empty list */
+    if (i < total && formals->cell[i]->sym == sym_amp) {
 
-        /* Check to ensure that & i s not passed invalidly */
-        if (f->formals->count != 2) {
+        /* Check to ensure that & is not passed invalidly */
+        if (total - i != 2) {
+            lval_del(f);
             return lval_err("Function format invalid. "
                             "Symbol '&' not followed by a single symbol");
         }
 
-        /* Pop and delete '&' symbol */
-        lval_del(lval_pop(f->formals, 0));
-
-        /* Pop next symbol and create empty list */
-        lval *sym = lval_pop(f->formals, 0);
         lval *val = lval_qexpr();
-
-        /* Bind to environment and delete */
-        lenv_put(f->env, sym, val);
-        lval_del(sym);
+        lenv_put(env, formals->cell[i + 1], val);
         lval_del(val);
+        i += 2;
     }
 
-    /* If all formals have been bound, evaluate */
-    if (f->formals->count == 0) {
-        /* Set environment parent to evaluation environment */
-        f->env->par = e;
+    /* Leave the copy with the formals still to be bound. Its arguments
+       are now in the frame, so the code is compiled again for the rest,
+       where the bound ones are found in the environment. */
+    if (i > 0) {
+        lval *rest = lval_view(f->lambda->formals);
+        while (i--) {
+            lval_del(lval_pop(rest, 0));
+        }
+        f->lambda->formals = rest;
 
-        /* Evaluate and return */
-        return builtin_eval(f->env, lval_add(lval_sexpr(), lval_copy(f->body)));
-    } else {
-        /* Otherwise return partially evaluated function */
-        return lval_copy(f);
+        if (f->lambda->code) {
+            lcode_del(f->lambda->code);
+            f->lambda->code = rest->count
+                                  ? lcode_compile(rest, f->lambda->body)
+                                  : NULL;
+        }
     }
+
+    return f;
 }
 
-lval *builtin_gt(lenv *e, lval *a) { return builtin_ord(e, a, ">"); }
+lval *builtin_gt(lenv *e, lval *a) { return builtin_ord(e, a, LOP_GT); }
 
-lval *builtin_lt(lenv *e, lval *a) { return builtin_ord(e, a, "<"); }
+lval *builtin_lt(lenv *e, lval *a) { return builtin_ord(e, a, LOP_LT); }
 
-lval *builtin_ge(lenv *e, lval *a) { return builtin_ord(e, a, ">="); }
+lval *builtin_ge(lenv *e, lval *a) { return builtin_ord(e, a, LOP_GE); }
 
-lval *builtin_le(lenv *e, lval *a) { return builtin_ord(e, a, "<="); }
+lval *builtin_le(lenv *e, lval *a) { return builtin_ord(e, a, LOP_LE); }
 
-lval *builtin_ord(lenv *e, lval *a, char *op) {
-    LASSERT_NUM(op, a, 2);
-    LASSERT_TYPE(op, a, 0, LVAL_NUM);
-    LASSERT_TYPE(op, a, 1, LVAL_NUM);
+lval *builtin_gt_argv(lenv *e, int argc, lval **argv) {
+    return builtin_ord_argv(e, argc, argv, LOP_GT);
+}
 
-    int r;
-    if (strcmp(op, ">") == 0) {
-        r = (a->cell[0]->num > a->cell[1]->num);
-    }
-    if (strcmp(op, "<") == 0) {
-        r = (a->cell[0]->num < a->cell[1]->num);
-    }
+lval *builtin_lt_argv(lenv *e, int argc, lval **argv) {
+    return builtin_ord_argv(e, argc, argv, LOP_LT);
+}
 
-    if (strcmp(op, ">=") == 0) {
-        r = (a->cell[0]->num >= a->cell[1]->num);
-    }
+lval *builtin_ge_argv(lenv *e, int argc, lval **argv) {
+    return builtin_ord_argv(e, argc, argv, LOP_GE);
+}
 
-    if (strcmp(op, "<=") == 0) {
-        r = (a->cell[0]->num <= a->cell[1]->num);
-    }
+lval *builtin_le_argv(lenv *e, int argc, lval **argv) {
+    return builtin_ord_argv(e, argc, argv, LOP_LE);
+}
 
+lval *builtin_ord(lenv *e, lval *a, int op) {
+    lval *x = builtin_ord_argv(e, a->count, a->cell, op);
     lval_del(a);
+    return x;
+}
+
+lval *builtin_ord_argv(lenv *e, int argc, lval **argv, int op) {
+    if (argc != 2) {
+        return lval_err("Function '%s' must be called with %i arguments",
+                        lop_name[op], 2);
+    }
+    for (int i = 0; i < 2; i++) {
+        if (argv[i]->type != LVAL_NUM) {
+            return lval_err("Function '%s' passed incorrect type for "
+                            "argument %i. Got %s, expected %s",
+                            lop_name[op], i, ltype_name(argv[i]->type),
+                            ltype_name(LVAL_NUM));
+        }
+    }
+
+    long x = argv[0]->num;
+    long y = argv[1]->num;
 
-    return lval_num(r);
+    switch (op) {
+    case LOP_GT:
+        return lval_num(x > y);
+    case LOP_LT:
+        return lval_num(x < y);
+    case LOP_GE:
+        return lval_num(x >= y);
+    default:
+        return lval_num(x <= y);
+    }
 }
 
 int lval_eq(lval *x, lval *y) {
@@ -985,7 +2218,7 @@ int lval_eq(lval *x, lval *y) {
         return (strcmp(x->err, y->err) == 0);
 
     case LVAL_SYM:
-        return (strcmp(x->sym, y->sym) == 0);
+        return x->sym == y->sym;
 
     case LVAL_STR:
         return (strcmp(x->str, y->str) == 0);
@@ -995,11 +2228,29 @@ int lval_eq(lval *x, lval *y) {
         if (x->builtin || y->builtin) {
             return x->builtin == y->builtin;
         } else {
-            return lval_eq(x->formals, y->formals) && lval_eq(x->body, y->body);
+            return lval_eq(x->lambda->formals, y->lambda->formals) &&
+                   lval_eq(x->lambda->body, y->lambda->body);
+        }
+    /* Maps are equal with the same keys bound to equal values */
+    case LVAL_MAP:
+        if (x->map->count != y->map->count) {
+            return 0;
         }
+        for (int i = 0; i < x->map->cap; i++) {
+            lmap_slot *s = &x->map->slots[i];
+            if (s->key) {
+                lval *v = lmap_get(y->map, s->key);
+                if (!v || !lval_eq(s->val, v)) {
+                    return 0;
+                }
+            }
+        }
+        return 1;
+
     /* If lists compare every individual element */
     case LVAL_QEXPR:
     case LVAL_SEXPR:
+    case LVAL_VEC:
         if (x->count != y->count) {
             return 0;
         }
@@ -1010,60 +2261,61 @@ int lval_eq(lval *x, lval *y) {
         if (!lval_eq(x->cell[i], y->cell[i])) {
             return 0;
         }
-        /* Otherwise lists must be equal */
-        return 1;
-        break;
     }
 
-    return 0;
+    /* Otherwise lists must be equal */
+    return 1;
 }
 
-lval *builtin_cmp(lenv *e, lval *a, char *op) {
-    LASSERT_NUM(op, a, 2);
-
-    int r;
+lval *builtin_cmp(lenv *e, lval *a, int op) {
+    lval *x = builtin_cmp_argv(e, a->count, a->cell, op);
+    lval_del(a);
+    return x;
+}
 
-    if (strcmp(op, "==") == 0) {
-        r = lval_eq(a->cell[0], a->cell[1]);
+lval *builtin_cmp_argv(lenv *e, int argc, lval **argv, int op) {
+    if (argc != 2) {
+        return lval_err("Function '%s' must be called with %i arguments",
+                        lop_name[op], 2);
     }
-    if (strcmp(op, "!=") == 0) {
-        r = !lval_eq(a->cell[0], a->cell[1]);
-    }
-
-    lval_del(a);
 
-    return lval_num(r);
+    int r = lval_eq(argv[0], argv[1]);
+    return lval_num(op == LOP_EQ ? r : !r);
 }
 
-lval *builtin_eq(lenv *e, lval *a) { return builtin_cmp(e, a, "=="); }
+lval *builtin_eq(lenv *e, lval *a) { return builtin_cmp(e, a, LOP_EQ); }
 
-lval *builtin_ne(lenv *e, lval *a) { return builtin_cmp(e, a, "!="); }
+lval *builtin_ne(lenv *e, lval *a) { return builtin_cmp(e, a, LOP_NE); }
 
-lval *builtin_if(lenv *e, lval *a) {
+lval *builtin_eq_argv(lenv *e, int argc, lval **argv) {
+    return builtin_cmp_argv(e, argc, argv, LOP_EQ);
+}
+
+lval *builtin_ne_argv(lenv *e, int argc, lval **argv) {
+    return builtin_cmp_argv(e, argc, argv, LOP_NE);
+}
+
+/* Check the arguments of if and return the branch it evaluates */
+lval *builtin_if_expr(lval *a) {
     LASSERT_NUM("if", a, 3);
     LASSERT_TYPE("if", a, 0, LVAL_NUM);
     LASSERT_TYPE("if", a, 1, LVAL_QEXPR);
     LASSERT_TYPE("if", a, 2, LVAL_QEXPR);
 
-    /* Mark both expressions as evaluable */
-    lval *x;
-    a->cell[1]->type = LVAL_SEXPR;
-    a->cell[2]->type = LVAL_SEXPR;
-
-    if (a->cell[0]->num) {
-        /* If condition is true, evaluate first expression */
-        x = lval_eval(e, lval_pop(a, 1));
-    } else {
-        /* Otherwise evaluate second expression */
-        x = lval_eval(e, lval_pop(a, 2));
-    }
+    /* Take the first expression if condition is true, otherwise second */
+    lval *x = lval_pop(a, a->cell[0]->num ? 1 : 2);
     lval_del(a);
 
     return x;
 }
 
+lval *builtin_if(lenv *e, lval *a) {
+    return lval_eval_code(e, builtin_if_expr(a));
+}
+
 lval *lval_str(char *s) {
-    lval *v = malloc(sizeof(lval));
+    lval *v = lval_alloc();
+    v->refs = 1;
     v->type = LVAL_STR;
     v->str = malloc(strlen(s) + 1);
     strcpy(v->str, s);
@@ -1086,48 +2338,70 @@ void lval_print_str(lval *v) {
     free(escaped);
 }
 
+/* Evaluate an expression from a file being loaded */
+static void lval_load_expr(lenv *e, lval *expr) {
+    lval *x = lval_eval(e, expr);
+    /* If Evaluation leads to error print it */
+    if (x->type == LVAL_ERR) {
+        lval_println(x);
+    }
+    lval_del(x);
+
+    /* Between expressions is a safe point to collect garbage */
+    lgc_poll();
+}
+
 lval *builtin_load(lenv *e, lval *a) {
     LASSERT_NUM("load", a, 1);
     LASSERT_TYPE("load", a, 0, LVAL_STR);
 
-    /* Parse File given by string name */
-    mpc_result_t r;
-    if (mpc_parse_contents(a->cell[0]->str, Lispy, &r)) {
-
-        /* Read contents */
-        lval *expr = lval_read(r.output);
-        mpc_ast_delete(r.output);
+    lreader r;
+    lval *err = lread_open(&r, a->cell[0]->str);
+    if (err) {
+        lval *x = lval_err("Could not load Library %s", err->err);
+        lval_del(err);
+        lval_del(a);
+        return x;
+    }
 
-        /* Evaluate each Expression */
-        while (expr->count) {
-            lval *x = lval_eval(e, lval_pop(expr, 0));
-            /* If Evaluation leads to error print it */
-            if (x->type == LVAL_ERR) {
-                lval_println(x);
-            }
-            lval_del(x);
+    /* A file loaded before is evaluated from the forms cached for it */
+    lcache_key k;
+    lval *forms = lcache_get(e, &r, &k);
+    if (forms) {
+        for (int i = 0; i < forms->count; i++) {
+            lval_load_expr(e, lval_ref(forms->cell[i]));
         }
-
-        /* Delete expressions and arguments */
-        lval_del(expr);
+        lval_del(forms);
+        lread_close(&r);
         lval_del(a);
-
-        /* Return empty list */
         return lval_sexpr();
+    }
 
-    } else {
-        /* Get Parse Error as String */
-        char *err_msg = mpc_err_string(r.error);
-        mpc_err_delete(r.error);
-
-        /* Create new error message using it */
-        lval *err = lval_err("Could not load Library %s", err_msg);
-        free(err_msg);
-        lval_del(a);
+    /* Otherwise read and evaluate one expression at a time, so only the
+       expression being evaluated is held in memory unless the forms are
+       kept to be cached */
+    lval *keep = k.path ? lval_qexpr() : NULL;
+    lval *expr;
+    while ((expr = lread_next(&r))) {
+        if (keep) {
+            lval_add(keep, lval_ref(expr));
+        }
+        lval_load_expr(e, expr);
+    }
 
-        /* Cleanup and return error */
-        return err;
+    /* A syntax error stops the load after the expressions before it */
+    if (r.err && keep) {
+        lval_del(keep);
+        keep = NULL;
     }
+    lcache_put(&k, keep);
+
+    lval *x = r.err ? lval_err("Could not load Library %s", r.err->err)
+                    : lval_sexpr();
+    lread_close(&r);
+    lval_del(a);
+
+    return x;
 }
 
 lval *builtin_print(lenv *e, lval *a) {
@@ -1135,12 +2409,12 @@ lval *builtin_print(lenv *e, lval *a) {
     for (int i = 0; i < a->count; i++) {
         lval_print(a->cell[i]);
         putchar(' ');
-
-        /* Print a newline and delete arguments */
-        putchar('\n');
-        lval_del(a);
     }
 
+    /* Print a newline and delete arguments */
+    putchar('\n');
+    lval_del(a);
+
     return lval_sexpr();
 }
 
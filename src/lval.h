@@ -1,11 +1,17 @@
 #pragma once
 
-#include "mpc.h"
+#include <stddef.h>
 
 struct lval;
 struct lenv;
+struct lcode;
+struct llambda;
+struct lmap;
 typedef struct lval lval;
 typedef struct lenv lenv;
+typedef struct lcode lcode;
+typedef struct llambda llambda;
+typedef struct lmap lmap;
 
 enum {
     LVAL_ERR,
@@ -14,79 +20,169 @@ enum {
     LVAL_STR,
     LVAL_FUN,
     LVAL_SEXPR,
-    LVAL_QEXPR
+    LVAL_QEXPR,
+    LVAL_VEC,
+    LVAL_MAP
 };
 
 typedef lval *(*lbuiltin)(lenv *, lval *);
 
+/* Builtin taking its arguments in place, as the argc values at argv, which
+   stay owned by the caller. argv may point into the stack of the VM, so it
+   is only valid until the builtin evaluates anything. */
+typedef lval *(*lbuiltin_argv)(lenv *, int, lval **);
+
+/* Values are reference counted and shared. Anything that changes a value
+   in place must own it alone, see lval_unshare. Vectors and maps are the
+   exception: set!, push, put and remove change them in place, and every
+   holder sees the change.
+
+   Only the member of the union selected by type is valid. */
 struct lval {
     int type;
+    int refs;
+
+    union {
+        /* Basic */
+        long num;
+        char *err;
+        char *sym;
+        char *str;
+
+        /* Function, lambda is only set when builtin is NULL. A builtin
+           with call set may be called with its arguments in place. */
+        struct {
+            lbuiltin builtin;
+            union {
+                llambda *lambda;
+                lbuiltin_argv call;
+            };
+        };
+
+        /* Expression or vector, a view of count cells at offset off in a
+           block of cells which may be shared with other views */
+        struct {
+            int count;
+            int off;
+            struct lval **cell;
+        };
+
+        /* Map, kept out of line like lambda */
+        lmap *map;
+    };
+};
 
-    /* Basic */
-    long num;
-    char *err;
-    char *sym;
-    char *str;
-
-    /* Function */
-    lbuiltin builtin;
+/* User defined function, kept out of line to keep lval small */
+struct llambda {
     lenv *env;
     lval *formals;
     lval *body;
-
-    /* Expression */
-    int count;
-    struct lval **cell;
+    lcode *code;
 };
 
+/* Frame of bindings in an open addressing hash table keyed by interned
+   symbol names. A frame may be shared by several closures, which hold a
+   reference each. Lookups search the frame, then the frames it extends
+   through up, ending at the root environment, which has no up. */
 struct lenv {
-    lenv *par;
+    lenv *up;
+    int refs;
+    int pass;
     int count;
+    int cap;
     char **syms;
     lval **vals;
 };
 
 enum { LERR_DIV_ZERO, LERR_BAD_OP, LERR_BAD_NUM };
 
+/* Operators of the arithmetic and comparison builtins */
+enum { LOP_ADD, LOP_SUB, LOP_MUL, LOP_DIV, LOP_GT, LOP_LT, LOP_GE, LOP_LE,
+       LOP_EQ, LOP_NE };
+
 lval *lval_num(long x);
 lval *lval_err(char *fmt, ...);
+lval *lval_err_shared(char *msg);
 lval *lval_sym(char *s);
+lval *lval_sym_len(char *s, size_t n);
 lval *lval_sexpr(void);
 lval *lval_qexpr(void);
-lval *lval_lambda(lval *formals, lval *body);
+lval *lval_vec(void);
+lval *lval_map(void);
+lval *lval_fun(lbuiltin func);
+lval *lval_lambda(lenv *e, lval *formals, lval *body);
 lval *lval_str(char *s);
 
-lval *lval_read_num(mpc_ast_t *t);
-lval *lval_read_str(mpc_ast_t *t);
-
 lval *lval_add(lval *v, lval *x);
+void lval_reserve(lval *v, int n);
 lval *lval_join(lval *x, lval *y);
 
 void lval_print(lval *v);
 void lval_print_str(lval *v);
 void lval_expr_print(lval *v, char open, char close);
+void lval_map_print(lval *v);
 
 lval *lval_take(lval *v, int i);
 lval *lval_pop(lval *v, int i);
 lval *lval_call(lenv *e, lval *f, lval *a);
+lval *lval_call_sexpr(lenv *e, lval *v);
+lval *lval_bind(lval *f, lval *a);
 
 char *ltype_name(int t);
 
 int lval_eq(lval *x, lval *y);
 
-lval *builtin_op(lenv *e, lval *a, char *op);
+lval *builtin_op(lenv *e, lval *a, int op);
+lval *builtin_op_argv(lenv *e, int argc, lval **argv, int op);
 lval *builtin_head(lenv *e, lval *a);
 lval *builtin_tail(lenv *e, lval *a);
 lval *builtin_list(lenv *e, lval *a);
 lval *builtin_eval(lenv *e, lval *a);
 lval *builtin_join(lenv *e, lval *a);
 lval *builtin_def(lenv *e, lval *a);
+lval *builtin_put(lenv *e, lval *a);
 lval *builtin_lambda(lenv *e, lval *a);
 lval *builtin_if(lenv *e, lval *a);
+lval *builtin_let(lenv *e, lval *a);
 lval *builtin_load(lenv *e, lval *a);
 lval *builtin_print(lenv *e, lval *a);
 lval *builtin_error(lenv *e, lval *a);
 
+/* Vector functions */
+lval *builtin_vec(lenv *e, lval *a);
+lval *builtin_nth(lenv *e, lval *a);
+lval *builtin_len(lenv *e, lval *a);
+lval *builtin_set(lenv *e, lval *a);
+lval *builtin_slice(lenv *e, lval *a);
+lval *builtin_push(lenv *e, lval *a);
+
+/* Map functions */
+lval *builtin_hash_map(lenv *e, lval *a);
+lval *builtin_get(lenv *e, lval *a);
+lval *builtin_map_put(lenv *e, lval *a);
+lval *builtin_remove(lenv *e, lval *a);
+lval *builtin_keys(lenv *e, lval *a);
+
+/* Bulk numeric functions over vectors */
+lval *builtin_vop(lenv *e, lval *a, int op);
+lval *builtin_vadd(lenv *e, lval *a);
+lval *builtin_vsub(lenv *e, lval *a);
+lval *builtin_vmul(lenv *e, lval *a);
+lval *builtin_vgt(lenv *e, lval *a);
+lval *builtin_vlt(lenv *e, lval *a);
+lval *builtin_vge(lenv *e, lval *a);
+lval *builtin_vle(lenv *e, lval *a);
+lval *builtin_veq(lenv *e, lval *a);
+lval *builtin_vne(lenv *e, lval *a);
+lval *builtin_vsum(lenv *e, lval *a);
+lval *builtin_vmin(lenv *e, lval *a);
+lval *builtin_vmax(lenv *e, lval *a);
+lval *builtin_vdot(lenv *e, lval *a);
+
+lval *builtin_eval_expr(lval *a);
+lval *builtin_if_expr(lval *a);
+lval *builtin_let_frame(lenv *e, lval *a);
+
 /* Comparison functions */
 lval *builtin_gt(lenv *e, lval *a);
 lval *builtin_lt(lenv *e, lval *a);
@@ -94,20 +190,40 @@ lval *builtin_ge(lenv *e, lval *a);
 lval *builtin_le(lenv *e, lval *a);
 lval *builtin_eq(lenv *e, lval *a);
 lval *builtin_ne(lenv *e, lval *a);
-
-lval *builtin_ord(lenv *e, lval *a, char *op);
-lval *builtin_cmp(lenv *e, lval *a, char *op);
+lval *builtin_gt_argv(lenv *e, int argc, lval **argv);
+lval *builtin_lt_argv(lenv *e, int argc, lval **argv);
+lval *builtin_ge_argv(lenv *e, int argc, lval **argv);
+lval *builtin_le_argv(lenv *e, int argc, lval **argv);
+lval *builtin_eq_argv(lenv *e, int argc, lval **argv);
+lval *builtin_ne_argv(lenv *e, int argc, lval **argv);
+
+lval *builtin_ord(lenv *e, lval *a, int op);
+lval *builtin_cmp(lenv *e, lval *a, int op);
+lval *builtin_ord_argv(lenv *e, int argc, lval **argv, int op);
+lval *builtin_cmp_argv(lenv *e, int argc, lval **argv, int op);
 
 lval *builtin(lenv *e, lval *a, char *func);
 
 lval *lenv_get(lenv *e, lval *k);
-lenv *lenv_copy(lenv *e);
+lenv *lenv_ref(lenv *e);
+lenv *lenv_frame(lenv *up);
 void lenv_def(lenv *e, lval *k, lval *v);
-
+void lenv_put(lenv *e, lval *k, lval *v);
+
+lval *lval_ref(lval *v);
+lval *lval_copy(lval *v);
+lval *lval_unshare(lval *v);
+void lval_clear(lval *v);
+void lval_each_child(lval *v, int pass, void (*fn)(lval *, void *),
+                     void *ctx);
 void lval_del(lval *v);
 void lval_println(lval *v);
-lval *lval_read(mpc_ast_t *t);
 lval *lval_eval(lenv *e, lval *v);
+lval *lval_eval_code(lenv *e, lval *v);
 lenv *lenv_new(void);
 void lenv_add_builtins(lenv *e);
+char *lbuiltin_name(lbuiltin f);
+lbuiltin lbuiltin_find(char *name);
+lbuiltin_argv lbuiltin_call(lbuiltin f);
 void lenv_del(lenv *e);
+void lenv_clear(lenv *e);
@@ -2,100 +2,107 @@
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include "lcache.h"
+#include "lgc.h"
+#include "limage.h"
+#include "lread.h"
 #include "lval.h"
-#include "mpc.h"
-
-/* Parser Declariations */
-
-mpc_parser_t *Number;
-mpc_parser_t *Symbol;
-mpc_parser_t *String;
-mpc_parser_t *Comment;
-mpc_parser_t *Sexpr;
-mpc_parser_t *Qexpr;
-mpc_parser_t *Expr;
-mpc_parser_t *Lispy;
 
 int main(int argc, char **argv) {
 
-    Number = mpc_new("number");
-    Symbol = mpc_new("symbol");
-    String = mpc_new("string");
-    Comment = mpc_new("comment");
-    Sexpr = mpc_new("sexpr");
-    Qexpr = mpc_new("qexpr");
-    Expr = mpc_new("expr");
-    Lispy = mpc_new("lispy");
-
-    mpca_lang(MPCA_LANG_DEFAULT,
-              "                                              \
-      number  : /-?[0-9]+/ ;                       \
-      symbol  : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ; \
-      string  : /\"(\\\\.|[^\"])*\"/ ;             \
-      comment : /;[^\\r\\n]*/ ;                    \
-      sexpr   : '(' <expr>* ')' ;                  \
-      qexpr   : '{' <expr>* '}' ;                  \
-      expr    : <number>  | <symbol> | <string>    \
-              | <comment> | <sexpr>  | <qexpr>;    \
-      lispy   : /^/ <expr>* /$/ ;                  \
-    ",
-              Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy);
-
     lenv *e = lenv_new();
     lenv_add_builtins(e);
 
-    /* Interactive Prompt */
-    if (argc == 1) {
-
-        puts("Lispy Version 0.0.0.1.0");
-        puts("Press Ctrl+c to Exit\n");
+    /* Arguments are handled in order. Images are bound into the global
+       environment, --no-cache keeps the files loaded after it out of the
+       cache on disk, and anything else is a file to load. */
+    char *dump = NULL;
+    int files = 0;
+    for (int i = 1; i < argc; i++) {
+
+        if ((strcmp(argv[i], "--load-image") == 0 ||
+             strcmp(argv[i], "--dump-image") == 0) &&
+            i + 1 == argc) {
+            fprintf(stderr, "Missing image file after %s\n", argv[i]);
+            lenv_clear(e);
+            lenv_del(e);
+            return 1;
+        }
 
-        while (1) {
+        if (strcmp(argv[i], "--load-image") == 0) {
+            lval *x = limage_load(e, argv[++i]);
+            if (x) {
+                lval_println(x);
+                lval_del(x);
+            }
+            continue;
+        }
 
-            char *input = readline("lispy> ");
-            add_history(input);
+        if (strcmp(argv[i], "--no-cache") == 0) {
+            lcache_disable_disk();
+            continue;
+        }
 
-            mpc_result_t r;
-            if (mpc_parse("<stdin>", input, Lispy, &r)) {
+        /* The image is written once everything else has been loaded */
+        if (strcmp(argv[i], "--dump-image") == 0) {
+            dump = argv[++i];
+            continue;
+        }
 
-                lval *x = lval_eval(e, lval_read(r.output));
-                lval_println(x);
-                lval_del(x);
+        /* Argument list with a single argument, the filename */
+        lval *args = lval_add(lval_sexpr(), lval_str(argv[i]));
 
-                mpc_ast_delete(r.output);
-            } else {
-                mpc_err_print(r.error);
-                mpc_err_delete(r.error);
-            }
+        /* Pass to builtin load and get the result */
+        lval *x = builtin_load(e, args);
 
-            free(input);
+        /* If the result is an error be sure to print it */
+        if (x->type == LVAL_ERR) {
+            lval_println(x);
         }
+        lval_del(x);
+        files++;
     }
 
-    /* Supplied with list of files */
-    if (argc >= 2) {
+    if (dump) {
+        lval *x = limage_dump(e, dump);
+        if (x) {
+            lval_println(x);
+            lval_del(x);
+        }
+    }
 
-        /* loop over each supplied filename (starting from 1) */
-        for (int i = 1; i < argc; i++) {
+    /* Interactive Prompt */
+    if (!files && !dump) {
 
-            /* Argument list with a single argument, the filename */
-            lval *args = lval_add(lval_sexpr(), lval_str(argv[i]));
+        puts("Lispy Version 0.0.0.1.0");
+        puts("Press Ctrl+c to Exit\n");
 
-            /* Pass to builtin load and get the result */
-            lval *x = builtin_load(e, args);
+        while (1) {
 
-            /* If the result is an error be sure to print it */
-            if (x->type == LVAL_ERR) {
-                lval_println(x);
+            char *input = readline("lispy> ");
+            if (!input) {
+                break;
             }
+            add_history(input);
+
+            /* The line is evaluated as one S-Expression */
+            lreader r;
+            lread_init(&r, "<stdin>", input, strlen(input));
+
+            lval *x = lval_eval(e, lread_all(&r));
+            lval_println(x);
             lval_del(x);
+            lgc_poll();
+
+            free(input);
         }
     }
 
+    lcache_clear();
+    lenv_clear(e);
     lenv_del(e);
 
-    mpc_cleanup(8, Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy);
-
     return 0;
 }
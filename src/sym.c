@@ -0,0 +1,111 @@
+#include "sym.h"
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    unsigned long hash;
+    void *data;
+    char name[];
+} lsym;
+
+/* Open addressing table of every interned symbol */
+static lsym **table = NULL;
+static int table_count = 0;
+static int table_cap = 0;
+
+char *sym_amp = NULL;
+char *sym_def = NULL;
+char *sym_put = NULL;
+char *sym_if = NULL;
+char *sym_lambda = NULL;
+char *sym_let = NULL;
+
+static unsigned long sym_hash_str(char *s, size_t n) {
+    /* FNV-1a */
+    unsigned long h = 14695981039346656037UL;
+    for (size_t i = 0; i < n; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 1099511628211UL;
+    }
+    return h;
+}
+
+static void sym_grow(void) {
+    int cap = table_cap ? table_cap * 2 : 256;
+    lsym **t = calloc(cap, sizeof(lsym *));
+
+    /* Reinsert existing symbols into the larger table */
+    for (int i = 0; i < table_cap; i++) {
+        if (table[i]) {
+            unsigned long j = table[i]->hash & (cap - 1);
+            while (t[j]) {
+                j = (j + 1) & (cap - 1);
+            }
+            t[j] = table[i];
+        }
+    }
+
+    free(table);
+    table = t;
+    table_cap = cap;
+}
+
+static void sym_init(void) {
+    sym_grow();
+
+    sym_amp = sym_intern("&");
+    sym_def = sym_intern("def");
+    sym_put = sym_intern("=");
+    sym_if = sym_intern("if");
+    sym_lambda = sym_intern("\\");
+    sym_let = sym_intern("let");
+}
+
+char *sym_intern(char *s) { return sym_intern_len(s, strlen(s)); }
+
+/* Intern the n characters at s, which need not be nul terminated */
+char *sym_intern_len(char *s, size_t n) {
+    /* The names looked for by the interpreter are interned first */
+    if (!table) {
+        sym_init();
+    }
+
+    /* Keep the load factor under a half */
+    if (table_count * 2 >= table_cap) {
+        sym_grow();
+    }
+
+    unsigned long h = sym_hash_str(s, n);
+    unsigned long i = h & (table_cap - 1);
+
+    while (table[i]) {
+        if (table[i]->hash == h && strncmp(table[i]->name, s, n) == 0 &&
+            table[i]->name[n] == '\0') {
+            return table[i]->name;
+        }
+        i = (i + 1) & (table_cap - 1);
+    }
+
+    /* Not seen before, so store a new entry */
+    lsym *y = malloc(sizeof(lsym) + n + 1);
+    y->hash = h;
+    y->data = NULL;
+    memcpy(y->name, s, n);
+    y->name[n] = '\0';
+
+    table[i] = y;
+    table_count++;
+
+    return y->name;
+}
+
+unsigned long sym_hash(char *s) {
+    /* s must come from sym_intern */
+    return ((lsym *)(s - offsetof(lsym, name)))->hash;
+}
+
+void **sym_data(char *s) {
+    /* s must come from sym_intern */
+    return &((lsym *)(s - offsetof(lsym, name)))->data;
+}
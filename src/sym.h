@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stddef.h>
+
+/* Interned symbol names. Every distinct name is stored once, so interned
+   names can be compared by pointer and carry a precomputed hash. */
+
+char *sym_intern(char *s);
+char *sym_intern_len(char *s, size_t n);
+unsigned long sym_hash(char *s);
+
+/* Slot for one pointer of data kept alongside an interned name */
+void **sym_data(char *s);
+
+/* Interned names the interpreter looks for itself */
+extern char *sym_amp;
+extern char *sym_def;
+extern char *sym_put;
+extern char *sym_if;
+extern char *sym_lambda;
+extern char *sym_let;
@@ -0,0 +1,529 @@
+#include "vm.h"
+#include "lgc.h"
+#include "sym.h"
+#include <stdlib.h>
+
+/* State used while compiling a single lambda body */
+typedef struct {
+    lval *formals;
+    lcode *c;
+    int sp;
+    int cap;
+} lcompiler;
+
+static void compile_expr(lcompiler *cc, lval *v);
+static void compile_sexpr(lcompiler *cc, lval **cells, int count, int tail);
+
+static void emit(lcompiler *cc, int x) {
+    if (cc->c->count == cc->cap) {
+        cc->cap = cc->cap ? cc->cap * 2 : 16;
+        cc->c->code = realloc(cc->c->code, sizeof(int) * cc->cap);
+    }
+    cc->c->code[cc->c->count++] = x;
+}
+
+static void push(lcompiler *cc, int n) {
+    cc->sp += n;
+    if (cc->sp > cc->c->depth) {
+        cc->c->depth = cc->sp;
+    }
+}
+
+static int add_const(lcompiler *cc, lval *v) {
+    lcode *c = cc->c;
+    c->nconsts++;
+    c->consts = realloc(c->consts, sizeof(lval *) * c->nconsts);
+    c->consts[c->nconsts - 1] = lval_ref(v);
+
+    return c->nconsts - 1;
+}
+
+/* Slot of the formal named sym. '&' takes no slot of its own. */
+static int formal_index(lval *formals, char *sym) {
+    int slot = 0;
+    for (int i = 0; i < formals->count; i++) {
+        if (formals->cell[i]->sym == sym) {
+            return slot;
+        }
+        if (formals->cell[i]->sym != sym_amp) {
+            slot++;
+        }
+    }
+    return -1;
+}
+
+/* Does any symbol inside v rebind a variable with '=' */
+static int compile_assigns(lval *v) {
+    if (v->type == LVAL_SYM) {
+        return v->sym == sym_put;
+    }
+    if (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) {
+        for (int i = 0; i < v->count; i++) {
+            if (compile_assigns(v->cell[i])) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/* Is this S-Expression a call to 'if' with literal branches. Whether 'if'
+   is still the builtin is checked each time the code runs. */
+static int compile_is_if(lcompiler *cc, lval **cells, int count) {
+    return count == 4 && cells[0]->type == LVAL_SYM &&
+           cells[0]->sym == sym_if &&
+           formal_index(cc->formals, sym_if) == -1 &&
+           cells[2]->type == LVAL_QEXPR && cells[3]->type == LVAL_QEXPR;
+}
+
+/* Call the function the first value evaluates to on the others */
+static void compile_call(lcompiler *cc, lval **cells, int count, int tail) {
+    for (int i = 0; i < count; i++) {
+        compile_expr(cc, cells[i]);
+    }
+    emit(cc, tail ? OP_TAIL : OP_CALL);
+    emit(cc, count);
+    cc->sp -= count;
+    push(cc, 1);
+}
+
+static void compile_expr(lcompiler *cc, lval *v) {
+    switch (v->type) {
+    case LVAL_SYM: {
+        int i = formal_index(cc->formals, v->sym);
+        if (i != -1) {
+            emit(cc, OP_LOCAL);
+            emit(cc, i);
+        } else {
+            emit(cc, OP_GLOBAL);
+            emit(cc, add_const(cc, v));
+        }
+        push(cc, 1);
+        break;
+    }
+
+    case LVAL_SEXPR:
+        compile_sexpr(cc, v->cell, v->count, 0);
+        break;
+
+    /* Everything else evaluates to itself */
+    default:
+        emit(cc, OP_CONST);
+        emit(cc, add_const(cc, v));
+        push(cc, 1);
+        break;
+    }
+}
+
+/* Compile a call. In tail position the result is returned unchanged,
+   so the call may replace the running frame. */
+static void compile_sexpr(lcompiler *cc, lval **cells, int count, int tail) {
+    /* An empty S-Expression evaluates to itself, with nothing to call */
+    if (count == 0) {
+        lval *x = lval_sexpr();
+        emit(cc, OP_CONST);
+        emit(cc, add_const(cc, x));
+        lval_del(x);
+        push(cc, 1);
+        return;
+    }
+
+    if (!compile_is_if(cc, cells, count)) {
+        compile_call(cc, cells, count, tail);
+        return;
+    }
+
+    /* Branch inline only while 'if' is the builtin */
+    emit(cc, OP_IF);
+    emit(cc, add_const(cc, cells[0]));
+    int to_call = cc->c->count;
+    emit(cc, 0);
+
+    /* Condition, then branch over the first expression */
+    compile_expr(cc, cells[1]);
+    emit(cc, OP_BRANCH);
+    int to_else = cc->c->count;
+    emit(cc, 0);
+    cc->sp--;
+
+    compile_sexpr(cc, cells[2]->cell, cells[2]->count, tail);
+    emit(cc, OP_JUMP);
+    int to_end_then = cc->c->count;
+    emit(cc, 0);
+    cc->sp--;
+
+    cc->c->code[to_else] = cc->c->count;
+    compile_sexpr(cc, cells[3]->cell, cells[3]->count, tail);
+    emit(cc, OP_JUMP);
+    int to_end_else = cc->c->count;
+    emit(cc, 0);
+    cc->sp--;
+
+    /* Otherwise 'if' is called like any other function */
+    cc->c->code[to_call] = cc->c->count;
+    compile_call(cc, cells, count, tail);
+
+    cc->c->code[to_end_then] = cc->c->count;
+    cc->c->code[to_end_else] = cc->c->count;
+}
+
+lcode *lcode_compile(lval *formals, lval *body) {
+    /* '&' must come just before the last formal. Other uses are reported
+       by lval_bind when the function is called. */
+    int amp = formal_index(formals, sym_amp);
+    if (amp != -1 && (amp != formals->count - 2 ||
+                      formals->cell[amp + 1]->sym == sym_amp)) {
+        return NULL;
+    }
+
+    /* '=' may rebind an argument behind the back of its slot */
+    if (compile_assigns(body)) {
+        return NULL;
+    }
+
+    lcode *c = calloc(1, sizeof(lcode));
+    c->refs = 1;
+    c->nslots = amp != -1 ? formals->count - 1 : formals->count;
+    c->rest = amp != -1;
+
+    lcompiler cc = {formals, c, 0, 0};
+
+    /* The body is evaluated as an S-Expression */
+    compile_sexpr(&cc, body->cell, body->count, 1);
+    emit(&cc, OP_RETURN);
+
+    return c;
+}
+
+lcode *lcode_ref(lcode *c) {
+    if (c) {
+        c->refs++;
+    }
+    return c;
+}
+
+void lcode_del(lcode *c) {
+    if (!c || --c->refs > 0) {
+        return;
+    }
+
+    for (int i = 0; i < c->nconsts; i++) {
+        lval_del(c->consts[i]);
+    }
+    free(c->consts);
+    free(c->code);
+    free(c);
+}
+
+/* Builtins which look at the environment they are called in */
+static int vm_needs_env(lval *f) {
+    if (f->type != LVAL_FUN) {
+        return 0;
+    }
+
+    return f->builtin == builtin_eval || f->builtin == builtin_if ||
+           f->builtin == builtin_load || f->builtin == builtin_put ||
+           f->builtin == builtin_lambda || f->builtin == builtin_let;
+}
+
+/* Bind the arguments into a copy of f, as lval_bind would have done */
+static lval *vm_frame(lval *f, lval **slots) {
+    lval *frame = lval_copy(f);
+    lenv_del(frame->lambda->env);
+    frame->lambda->env = lenv_frame(f->lambda->env);
+
+    lval *formals = f->lambda->formals;
+    for (int i = 0, slot = 0; i < formals->count; i++) {
+        if (formals->cell[i]->sym != sym_amp) {
+            lenv_put(frame->lambda->env, formals->cell[i], slots[slot++]);
+        }
+    }
+
+    return frame;
+}
+
+/* Lay out the arguments a as the slots of c, gathering any rest */
+static lval *vm_args(lcode *c, lval *a) {
+    if (!c->rest) {
+        return a;
+    }
+
+    int fixed = c->nslots - 1;
+    lval *rest = lval_qexpr();
+    lval_reserve(rest, a->count - fixed);
+    for (int i = fixed; i < a->count; i++) {
+        lval_add(rest, lval_ref(a->cell[i]));
+    }
+
+    a = lval_unshare(a);
+    while (a->count > fixed) {
+        lval_del(lval_pop(a, a->count - 1));
+    }
+
+    return lval_add(a, rest);
+}
+
+/* Move n stack values into a new S-Expression */
+static lval *vm_sexpr(lval **values, int n) {
+    lval *v = lval_sexpr();
+    lval_reserve(v, n);
+    for (int i = 0; i < n; i++) {
+        lval_add(v, values[i]);
+    }
+
+    return v;
+}
+
+/* Value stack shared by every running VM frame */
+static lval **vm_stack = NULL;
+static int vm_top = 0;
+static int vm_cap = 0;
+
+/* Reserve depth slots from base upwards. Nested calls may move the stack,
+   so frames keep their base and reload this pointer after each call. */
+static lval **vm_reserve(int base, int depth) {
+    if (base + depth > vm_cap) {
+        vm_cap = (base + depth) * 2;
+        vm_stack = realloc(vm_stack, sizeof(lval *) * vm_cap);
+    }
+    vm_top = base + depth;
+
+    return vm_stack + base;
+}
+
+/* Is the call of f one that is left to the caller in tail position */
+static int vm_is_tail_builtin(lval *f, ltail *tail) {
+    return tail && (f->builtin == builtin_eval || f->builtin == builtin_if ||
+                    f->builtin == builtin_let);
+}
+
+/* Can the n values at the top of the stack be called in tail position */
+static int vm_is_tail_call(lval **values, int n, ltail *tail) {
+    if (n < 2 || values[0]->type != LVAL_FUN) {
+        return 0;
+    }
+    if (values[0]->builtin && !vm_is_tail_builtin(values[0], tail)) {
+        return 0;
+    }
+    for (int i = 1; i < n; i++) {
+        if (values[i]->type == LVAL_ERR) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* An error is the value of every call around it, so it ends the body at
+   once. The error is left alone at the bottom of the stack for the final
+   return, and the new stack pointer returned. */
+static int vm_fail(lval **stack, int sp) {
+    lval *err = stack[--sp];
+    while (sp) {
+        lval_del(stack[--sp]);
+    }
+    stack[0] = err;
+
+    return 1;
+}
+
+int vm_can_run(lval *f, lval *a) {
+    if (f->builtin || !f->lambda->code) {
+        return 0;
+    }
+
+    lcode *c = f->lambda->code;
+    return c->rest ? a->count >= c->nslots - 1 : a->count == c->nslots;
+}
+
+/* Run the compiled function f on the arguments a. If tail is given, calls
+   in tail position which cannot reuse the VM frame are stored there and
+   NULL is returned, so the caller can make them without nesting. */
+lval *vm_run(lenv *e, lval *f, lval *a, ltail *tail) {
+    lcode *c = f->lambda->code;
+    lval *frame = NULL;
+
+    a = vm_args(c, a);
+    lval **slots = a->cell;
+
+    /* f is replaced by tail calls, so hold our own reference */
+    f = lval_ref(f);
+
+    int base = vm_top;
+    lval **stack = vm_reserve(base, c->depth);
+    int sp = 0;
+    int pc = 0;
+
+    while (1) {
+        switch (c->code[pc++]) {
+        case OP_CONST:
+            stack[sp++] = lval_ref(c->consts[c->code[pc++]]);
+            break;
+
+        case OP_LOCAL:
+            stack[sp++] = lval_ref(slots[c->code[pc++]]);
+            break;
+
+        case OP_GLOBAL:
+            /* Arguments are never looked up by name, so the environment
+               the function closes over sees the same bindings as the
+               frame */
+            stack[sp++] = lenv_get(frame ? frame->lambda->env : f->lambda->env,
+                                   c->consts[c->code[pc++]]);
+            if (stack[sp - 1]->type == LVAL_ERR) {
+                sp = vm_fail(stack, sp);
+                pc = c->count - 1;
+            }
+            break;
+
+        case OP_TAIL:
+            if (vm_is_tail_call(&stack[sp - c->code[pc]], c->code[pc], tail)) {
+                int n = c->code[pc++];
+                sp -= n;
+
+                lval *g = stack[sp];
+                lval *args = vm_sexpr(&stack[sp + 1], n - 1);
+
+                /* eval, if and let run in the environment of this frame */
+                if (g->builtin && !frame) {
+                    frame = vm_frame(f, slots);
+                }
+
+                /* Functions close over their own environment, so the
+                   frame is of no further use */
+                if (!g->builtin && frame) {
+                    lval_del(frame);
+                    frame = NULL;
+                }
+
+                if (!vm_can_run(g, args)) {
+                    if (tail) {
+                        tail->frame = frame;
+                        tail->f = g;
+                        tail->args = args;
+                        lval_del(a);
+                        lval_del(f);
+                        vm_top = base;
+                        return NULL;
+                    }
+
+                    /* The call may move the stack */
+                    lval *x = lval_call(e, g, args);
+                    lval_del(g);
+                    stack = vm_stack + base;
+                    stack[sp++] = x;
+                    if (x->type == LVAL_ERR) {
+                        sp = vm_fail(stack, sp);
+                        pc = c->count - 1;
+                    }
+                    break;
+                }
+
+                /* Reuse this frame and run the callee from the start */
+                lval_del(a);
+                lval_del(f);
+                f = g;
+                c = f->lambda->code;
+                a = vm_args(c, args);
+                slots = a->cell;
+                stack = vm_reserve(base, c->depth);
+                sp = 0;
+                pc = 0;
+
+                /* A loop may never leave the VM, so collect here too */
+                lgc_poll();
+                break;
+            }
+            /* Otherwise there is no frame to replace, so call normally */
+            /* fallthrough */
+
+        case OP_CALL: {
+            int n = c->code[pc++];
+            sp -= n;
+
+            /* Builtins taking their arguments in place are called on the
+               stack. They evaluate nothing, so the stack cannot move. */
+            lval *g = stack[sp];
+            if (n > 1 && g->type == LVAL_FUN && g->builtin && g->call) {
+                lval *x = g->call(frame ? frame->lambda->env : e, n - 1,
+                                  &stack[sp + 1]);
+                for (int i = 0; i < n; i++) {
+                    lval_del(stack[sp + i]);
+                }
+                stack[sp++] = x;
+                if (x->type == LVAL_ERR) {
+                    sp = vm_fail(stack, sp);
+                    pc = c->count - 1;
+                }
+                break;
+            }
+
+            if (!frame && n > 1 && vm_needs_env(stack[sp])) {
+                frame = vm_frame(f, slots);
+            }
+            lval *x = lval_call_sexpr(frame ? frame->lambda->env : e,
+                                      vm_sexpr(&stack[sp], n));
+
+            stack = vm_stack + base;
+            stack[sp++] = x;
+            if (x->type == LVAL_ERR) {
+                sp = vm_fail(stack, sp);
+                pc = c->count - 1;
+            }
+            break;
+        }
+
+        case OP_IF: {
+            lval *g = lenv_get(frame ? frame->lambda->env : f->lambda->env,
+                               c->consts[c->code[pc++]]);
+            int to_call = c->code[pc++];
+            if (g->type != LVAL_FUN || g->builtin != builtin_if) {
+                pc = to_call;
+            }
+            lval_del(g);
+            break;
+        }
+
+        case OP_BRANCH: {
+            lval *x = stack[--sp];
+            int to_else = c->code[pc++];
+
+            if (x->type == LVAL_NUM) {
+                if (!x->num) {
+                    pc = to_else;
+                }
+                lval_del(x);
+                break;
+            }
+
+            /* Any other condition is an error, which ends the body */
+            if (x->type != LVAL_ERR) {
+                lval *err = lval_err("Function '%s' passed incorrect type for "
+                                     "argument %i. Got %s, expected %s",
+                                     "if", 0, ltype_name(x->type),
+                                     ltype_name(LVAL_NUM));
+                lval_del(x);
+                x = err;
+            }
+            stack[sp++] = x;
+            sp = vm_fail(stack, sp);
+            pc = c->count - 1;
+            break;
+        }
+
+        case OP_JUMP:
+            pc = c->code[pc];
+            break;
+
+        case OP_RETURN: {
+            lval *x = stack[--sp];
+            if (frame) {
+                lval_del(frame);
+            }
+            lval_del(a);
+            lval_del(f);
+            vm_top = base;
+            return x;
+        }
+        }
+    }
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include "lval.h"
+
+/* Instruction set of the bytecode VM. Operands follow the opcode inline. */
+enum {
+    OP_CONST,  /* k      : push copy of constant k */
+    OP_LOCAL,  /* i      : push copy of argument slot i */
+    OP_GLOBAL, /* k      : push value of symbol constant k from environment */
+    OP_CALL,   /* n      : evaluate S-Expression built from top n values */
+    OP_TAIL,   /* n      : as OP_CALL, in tail position */
+    OP_IF,     /* k t    : jump to t unless symbol constant k is bound to the
+                  builtin if */
+    OP_BRANCH, /* t      : pop condition, jump to t if zero. Errors end the
+                  body */
+    OP_JUMP,   /* t      : jump to t */
+    OP_RETURN  /*        : return top of stack */
+};
+
+struct lcode {
+    /* Compiled code is immutable and shared between copies of a lambda */
+    int refs;
+
+    /* Last pass of the collector to visit the constants */
+    int pass;
+
+    /* Number of argument slots and maximum stack depth. With rest set the
+       last slot holds a list of the arguments after the others. */
+    int nslots;
+    int rest;
+    int depth;
+
+    /* Instruction stream */
+    int count;
+    int *code;
+
+    /* Constants pool */
+    int nconsts;
+    lval **consts;
+};
+
+/* A call in tail position left for the caller of vm_run to make */
+typedef struct {
+    /* Bound function whose environment the call is made in, or NULL */
+    lval *frame;
+
+    /* Function and evaluated arguments */
+    lval *f;
+    lval *args;
+} ltail;
+
+lcode *lcode_compile(lval *formals, lval *body);
+lcode *lcode_ref(lcode *c);
+void lcode_del(lcode *c);
+
+int vm_can_run(lval *f, lval *a);
+lval *vm_run(lenv *e, lval *f, lval *a, ltail *tail);